@@ -1,4 +1,5 @@
 #pragma once
+#include "raytracer/util.h"
 
 void InitPerformanceCounters();
 void StartMeasurement();
@@ -87,6 +88,9 @@ typedef unsigned __int64 uint64;
 #endif
 
 // Define low level functions
+// cpuid is shared with the instruction set dispatch of the raytracer
+static inline void Cpuid(int Output[4], int aa) { AGR::cpuid(Output, aa); }
+
 #ifdef _MSC_VER // __INTRIN_H_  // Use intrinsics for low level functions
 
 static volatile int DontSkip;
@@ -96,22 +100,11 @@ static inline void Serialize ()
     __cpuid(dummy, 0);
     DontSkip = dummy[0];
 }
-#define Cpuid __cpuid
 #define Readtsc __rdtsc
 #define Readpmc __readpmc
 
 #else // use gcc style inline assembly
 
-static void Cpuid (int Output[4], int aa) 
-{	
-	int a, b, c, d;
-	__asm("cpuid" : "=a"(a),"=b"(b),"=c"(c),"=d"(d) : "a"(aa),"c"(0) : );
-	Output[0] = a;
-	Output[1] = b;
-	Output[2] = c;
-	Output[3] = d;
-}
-
 static inline void Serialize() 
 {
 	__asm__ __volatile__ ( "xorl %%eax, %%eax \n cpuid " : : : "%eax","%ebx","%ecx","%edx" );
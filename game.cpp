@@ -5,18 +5,25 @@
 #include "raytracer/lights/PointLight.h"
 #include "raytracer/renederables/Triangle.h"
 #include "raytracer/renederables/Mesh.h"
+#include "raytracer/renederables/MeshInstance.h"
 #include "raytracer/renederables/Sphere.h"
+#include "raytracer/BVHCheck.h"
 
 // -----------------------------------------------------------
 // Initialize the application
 // -----------------------------------------------------------
-AGR::Mesh *hum1;
-AGR::Mesh *hum2;
+AGR::Mesh *cube;
+AGR::MeshInstance *hum1;
+AGR::MeshInstance *hum2;
 AGR::Mesh *arm;
 AGR::Mesh *teap;
 
 void Game::Init()
 {
+#ifdef _DEBUG
+	int mismatches = AGR::checkBVH();
+	if (mismatches) printf("bvh check: %d rays differ from testing every primitive\n", mismatches);
+#endif
 	float aspectRatio = static_cast<float>(screen->GetWidth()) / screen->GetHeight();
 	m_cam = new AGR::Camera(aspectRatio, 120, glm::vec3(0, 1.5, -5));
 	m_cam->setLensParams(5.5f, 0.1f, 3);
@@ -59,18 +66,20 @@ void Game::Init()
 		AGR::Vertex(glm::vec3(10, 0, 50), glm::vec2(0, 1)),
 		AGR::Vertex(glm::vec3(-10, 0, 50), glm::vec2(1, 0)), 
 		*m[0], true, false, false));
-	hum1 = new AGR::Mesh(*m[0]);
-	hum1->load("cube.obj", AGR::CONSISTENT);
+	cube = new AGR::Mesh(*m[0]);
+	cube->load("cube.obj", AGR::CONSISTENT);
+	hum1 = new AGR::MeshInstance(*cube);
 	hum1->setRotation(glm::vec3(0, 90, 0));
 	hum1->setScale(glm::vec3(9.0f));
 	hum1->setPosition(glm::vec3(3.0f, -9.0f, 16.0f));
 	hum1->commitTransformations();
-	hum2 = new AGR::Mesh(*m[3]);
-	hum2->load("cube.obj", AGR::CONSISTENT);
+	r.push_back(hum1);
+	hum2 = new AGR::MeshInstance(*cube, m[3]);
 	//hum2->setRotation(glm::vec3(0, -90, 0));
 	hum2->setScale(glm::vec3(0.5f));
 	hum2->setPosition(glm::vec3(2.1, 0.5, 2.0));
 	hum2->commitTransformations();
+	r.push_back(hum2);
 	arm = new AGR::Mesh(*m[4]);
 	arm->load("bunny.obj", AGR::CONSISTENT);
 	arm->setPosition(glm::vec3(0, 0, 0.5));
@@ -103,6 +112,7 @@ void Game::Shutdown()
 	delete m_cam;
 	for (auto cl : l) delete cl;
 	for (auto cr : r) delete cr;
+	delete cube;
 	for (auto cm : m) delete cm;
 	for (auto cs : s) delete cs;
 }
@@ -77,4 +77,9 @@ namespace AGR
 		glm::vec3 dim = m_maxPt - m_minPt;
 		return (dim.x * (dim.y + dim.z) + dim.y * dim.z) * 2;
 	}
+
+	AABB AABB::empty()
+	{
+		return AABB(glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX));
+	}
 }
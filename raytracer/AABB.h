@@ -20,6 +20,8 @@ namespace AGR
 		const glm::vec3& getMinPt() const;
 		const glm::vec3& getMaxPt() const;
 		float calcArea() const;
+		//inverted box, extending it by any box results in that box
+		static AABB empty();
 	private:
 		glm::vec3 m_minPt;
 		glm::vec3 m_maxPt;
@@ -0,0 +1,60 @@
+#pragma once
+#include <cstddef>
+#include <new>
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <stdlib.h>
+#endif
+
+namespace AGR
+{
+	//std::allocator only guarantees the alignment of the fundamental types,
+	//this one starts every block on an Alignment boundary
+	template<class T, size_t Alignment>
+	class AlignedAllocator
+	{
+	public:
+		typedef T value_type;
+
+		template<class U>
+		struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+		AlignedAllocator() {}
+		template<class U>
+		AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+		T *allocate(size_t n)
+		{
+#ifdef _WIN32
+			void *data = _aligned_malloc(n * sizeof(T), Alignment);
+#else
+			void *data = nullptr;
+			if (posix_memalign(&data, Alignment, n * sizeof(T)) != 0) data = nullptr;
+#endif
+			if (!data) throw std::bad_alloc();
+			return static_cast<T *>(data);
+		}
+
+		void deallocate(T *data, size_t)
+		{
+#ifdef _WIN32
+			_aligned_free(data);
+#else
+			free(data);
+#endif
+		}
+	};
+
+	template<class T, class U, size_t Alignment>
+	bool operator==(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&)
+	{
+		return true;
+	}
+
+	template<class T, class U, size_t Alignment>
+	bool operator!=(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&)
+	{
+		return false;
+	}
+}
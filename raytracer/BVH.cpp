@@ -1,23 +1,737 @@
-#include "BVH.h"
+#include "BVHTraversal.h"
 #include "util.h"
+#include "renederables/Triangle.h"
+#include "renederables/Sphere.h"
+#include "renederables/MeshInstance.h"
 #include <ppl.h>
+#include <algorithm>
+#include <memory>
+#include <queue>
+#include <functional>
+#include <fstream>
+#include <cstdio>
+#include <cassert>
 
 namespace AGR
 {
+	template<class BoxFunc>
+	AABB BVH::reduceBounds(int size, const BoxFunc& box)
+	{
+		const int chunksAm = 64;
+		int chunkSize = size / chunksAm + 1;
+		AABB partial[chunksAm];
+		concurrency::parallel_for(0, chunksAm, 1, [&](int iter) {
+			int from = chunkSize * iter;
+			int to = from + chunkSize < size ? from + chunkSize : size;
+			partial[iter] = AABB::empty();
+			for (int i = from; i < to; ++i) {
+				partial[iter].extend(box(i));
+			}
+		});
+		AABB result = partial[0];
+		for (int iter = 1; iter < chunksAm; ++iter) {
+			result.extend(partial[iter]);
+		}
+		return result;
+	}
 
 	void BVH::construct(std::vector<Primitive*>& primitives)
 	{
 		m_primitives = primitives;
-		sortPrimitivesByMortonCodes();
+		if (m_primitives.size() < 2) {
+			//nothing to split, the builders need at least two primitives
+			constructSingleLeaf();
+		} else {
+			switch (m_buildMethod) {
+			case BINNED_SAH:
+				constructBinnedSAH();
+				break;
+			case PLOC:
+				constructPLOC();
+				break;
+			case LBVH:
+				constructLBVH();
+				break;
+			case SBVH:
+				constructSBVH();
+				break;
+			default:
+				constructAgglomerative();
+				break;
+			}
+			for (int i = 0; i < m_treeletPasses; ++i) {
+				optimizeTreelets();
+			}
+		}
+		m_parents.clear();
+		collapseTree();
+		m_builtCost = m_nodesCount > 0 ? calcCost(0, 0, false) / m_nodes[0].bounds.calcArea() : 0.0f;
+	}
+
+	void BVH::constructSingleLeaf()
+	{
+		//the root is the leaf of the only primitive, an empty tree has no nodes
+		m_nodesCount = static_cast<int>(m_primitives.size());
+		m_nodes.resize(1);
+		if (m_nodesCount == 0) return;
+		m_nodes[0].bounds = m_primitives[0]->getBoundingBox();
+		m_nodes[0].primitiveNum = 0;
+		m_nodes[0].isLeaf = Node::LEAF_FLAG;
+	}
+
+	void BVH::collapseTree()
+	{
+		m_cacheFile.close();
+		m_wideNodesLayout = getNodeLayout();
+		m_collapseCosts.resize(m_nodesCount);
+		if (m_nodesCount > 0) calcCollapseCosts(0, 0, getLayoutWidth(m_wideNodesLayout));
+		clearWideNodes();
+		//every binary leaf ends up in exactly one wide node leaf
+		m_leafPrimitives.clear();
+		m_leafPrimitives.reserve((m_nodesCount + 1) / 2);
+		switch (m_wideNodesLayout) {
+		case OCT_NODES:
+			collapseTree(m_octNodes);
+			break;
+		case COMPRESSED_QUAD_NODES:
+			collapseTree(m_compressedQuadNodes);
+			break;
+		case COMPRESSED_OCT_NODES:
+			collapseTree(m_compressedOctNodes);
+			break;
+		default:
+			collapseTree(m_quadNodes);
+			break;
+		}
+		m_leafTriangles.resize(m_leafPrimitives.size());
+		m_leafSpheres.resize(m_leafPrimitives.size());
+		m_leafTypes.resize(m_leafPrimitives.size());
+		concurrency::parallel_for(0, static_cast<int>(m_leafPrimitives.size()), 1, [this](int i) {
+			setLeafCopies(i);
+		});
+		m_bounds = m_nodesCount > 0 ? m_nodes[0].bounds : AABB::empty();
+		m_isWideTreeDirty = false;
+	}
+
+	template<class WideNode>
+	void BVH::collapseTree(WideNodeVector<WideNode>& nodes)
+	{
+		//the root is always a wide node, a root leaf becomes its only child
+		//and an empty tree leaves it without children
+		bool isRootLeaf = m_nodesCount == 0 || (m_nodes[0].isLeaf & Node::LEAF_FLAG);
+		//counted first, so the only allocation is exactly as large as needed
+		nodes.resize(isRootLeaf ? 1 : countWideNodes(&m_nodes[0], WideNode::WIDTH));
+		m_wideNodesData = reinterpret_cast<char *>(nodes.data());
+		m_wideNodesCount = 1;
+		m_wideTreeDepth = 0;
+		Node *initialChildren[WideNode::WIDTH] = {};
+		if (!isRootLeaf) {
+			formWideNode(&m_nodes[0], initialChildren, WideNode::WIDTH);
+		} else if (m_nodesCount > 0) {
+			initialChildren[0] = &m_nodes[0];
+		}
+		buildWideTree(nodes.data(), 0, initialChildren, 1);
+		layoutWideNodes(nodes);
+		m_wideNodesData = reinterpret_cast<char *>(nodes.data());
+	}
+
+	BVH::NodeLayout BVH::getNodeLayout() const
+	{
+		//the 8 wide kernels need AVX2 and FMA, without them the nodes stay 4 wide
+		if (m_nodeWidth == OctNode::WIDTH && isAvx2Supported()) {
+			return m_compressedNodes ? COMPRESSED_OCT_NODES : OCT_NODES;
+		}
+		return m_compressedNodes ? COMPRESSED_QUAD_NODES : QUAD_NODES;
+	}
+
+	int BVH::getLayoutWidth(NodeLayout layout)
+	{
+		return layout == OCT_NODES || layout == COMPRESSED_OCT_NODES ? OctNode::WIDTH : QuadNode::WIDTH;
+	}
+
+	size_t BVH::getNodeSize(NodeLayout layout)
+	{
+		switch (layout) {
+		case OCT_NODES:
+			return sizeof(OctNode);
+		case COMPRESSED_QUAD_NODES:
+			return sizeof(CompressedQuadNode);
+		case COMPRESSED_OCT_NODES:
+			return sizeof(CompressedOctNode);
+		default:
+			return sizeof(QuadNode);
+		}
+	}
+
+	void BVH::clearWideNodes()
+	{
+		//swapped out, clear alone would keep the capacity
+		WideNodeVector<QuadNode>().swap(m_quadNodes);
+		WideNodeVector<OctNode>().swap(m_octNodes);
+		WideNodeVector<CompressedQuadNode>().swap(m_compressedQuadNodes);
+		WideNodeVector<CompressedOctNode>().swap(m_compressedOctNodes);
+		m_wideNodesData = nullptr;
+		m_wideNodesCount = 0;
+		m_wideTreeDepth = 0;
+	}
+
+	void BVH::construct(std::vector<Primitive*>& primitives, const std::string& cachePath)
+	{
+		::uint64_t hash = calcGeometryHash(primitives);
+		if (loadCache(cachePath, hash, primitives)) return;
+		construct(primitives);
+		saveCache(cachePath, hash, primitives);
+	}
+
+	::uint64_t BVH::calcGeometryHash(const std::vector<Primitive*>& primitives) const
+	{
+		//FNV-1a over 32 bit words, chunks are hashed in parallel and combined
+		const ::uint64_t prime = UINT64_C(0x100000001b3);
+		auto hashWords = [prime](::uint64_t hash, const ::uint32_t *words, size_t size) {
+			for (size_t i = 0; i < size; ++i) {
+				hash = (hash ^ words[i]) * prime;
+			}
+			return hash;
+		};
+		const int chunksAm = 64;
+		int size = static_cast<int>(primitives.size());
+		int chunkSize = size / chunksAm + 1;
+		::uint64_t partial[chunksAm];
+		concurrency::parallel_for(0, chunksAm, 1, [&](int iter) {
+			int from = chunkSize * iter;
+			int to = from + chunkSize < size ? from + chunkSize : size;
+			partial[iter] = UINT64_C(0xcbf29ce484222325);
+			for (int i = from; i < to; ++i) {
+				const AABB& bounds = primitives[i]->getBoundingBox();
+				partial[iter] = hashWords(partial[iter],
+					reinterpret_cast<const ::uint32_t *>(&bounds.getMinPt()), 3);
+				partial[iter] = hashWords(partial[iter],
+					reinterpret_cast<const ::uint32_t *>(&bounds.getMaxPt()), 3);
+				//leaves are tagged and ordered by the primitive types
+				::uint32_t type = getLeafType(primitives[i]);
+				partial[iter] = hashWords(partial[iter], &type, 1);
+				//SBVH clips triangles, so their vertices must be hashed
+				if (m_buildMethod == SBVH && type == TRIANGLE_LEAF) {
+					const Triangle *triangle = primitives[i]->asTriangle();
+					for (int k = 0; k < 3; ++k) {
+						partial[iter] = hashWords(partial[iter],
+							reinterpret_cast<const ::uint32_t *>(&triangle->m_vert[k].position), 3);
+					}
+				}
+			}
+		});
+		//the tree also depends on how it was built
+		::uint32_t settings[7];
+		settings[0] = static_cast<::uint32_t>(size);
+		settings[1] = static_cast<::uint32_t>(m_buildMethod);
+		settings[2] = static_cast<::uint32_t>(m_treeletPasses);
+		memcpy(&settings[3], &m_spatialSplitBudget, sizeof(settings[3]));
+		settings[4] = static_cast<::uint32_t>(getLayoutWidth(getNodeLayout()));
+		settings[5] = static_cast<::uint32_t>(m_compressedNodes);
+		settings[6] = static_cast<::uint32_t>(m_maxLeafSize);
+		::uint64_t hash = hashWords(UINT64_C(0xcbf29ce484222325), settings, 7);
+		return hashWords(hash, reinterpret_cast<const ::uint32_t *>(partial), chunksAm * 2);
+	}
+
+	void BVH::calcCacheLayout(int referencesAm, size_t& orderOffset, size_t& nodesOffset)
+	{
+		auto align = [](size_t offset) {
+			return (offset + CACHE_ALIGNMENT - 1) / CACHE_ALIGNMENT * CACHE_ALIGNMENT;
+		};
+		orderOffset = align(sizeof(CacheHeader));
+		nodesOffset = align(orderOffset + sizeof(int) * referencesAm);
+	}
+
+	bool BVH::loadCache(const std::string& path, ::uint64_t hash,
+		const std::vector<Primitive*>& primitives)
+	{
+		if (!m_cacheFile.open(path)) return false;
+		const char *data = m_cacheFile.getData();
+		CacheHeader header;
+		size_t orderOffset, nodesOffset;
+		NodeLayout layout = getNodeLayout();
+		size_t nodeSize = getNodeSize(layout);
+		bool valid = m_cacheFile.getSize() >= sizeof(header);
+		if (valid) {
+			memcpy(&header, data, sizeof(header));
+			calcCacheLayout(header.leafReferencesAm, orderOffset, nodesOffset);
+			valid = memcmp(header.magic, "AGRB", 4) == 0 &&
+				header.version == CACHE_VERSION &&
+				header.hash == hash &&
+				header.nodeLayout == layout &&
+				header.nodeSize == nodeSize &&
+				header.primitivesAm == static_cast<int>(primitives.size()) &&
+				header.leafReferencesAm >= header.primitivesAm &&
+				header.nodesAm > 0 &&
+				header.depth > 0 &&
+				m_cacheFile.getSize() >= nodesOffset + nodeSize * header.nodesAm;
+		}
+		if (!valid) {
+			m_cacheFile.close();
+			return false;
+		}
+		const int *order = reinterpret_cast<const int *>(data + orderOffset);
+		//a corrupt file or a colliding hash must not index past the primitives
+		for (int i = 0; i < header.leafReferencesAm; ++i) {
+			if (order[i] < 0 || order[i] >= header.primitivesAm) {
+				m_cacheFile.close();
+				return false;
+			}
+		}
+		m_primitives = primitives;
+		m_leafPrimitives.resize(header.leafReferencesAm);
+		m_leafTriangles.resize(header.leafReferencesAm);
+		m_leafSpheres.resize(header.leafReferencesAm);
+		m_leafTypes.resize(header.leafReferencesAm);
+		concurrency::parallel_for(0, header.leafReferencesAm, 1, [&](int i) {
+			m_leafPrimitives[i] = primitives[order[i]];
+			setLeafCopies(i);
+		});
+		//used in place, pages are read on first touch
+		clearWideNodes();
+		m_wideNodesData = m_cacheFile.getData() + nodesOffset;
+		m_wideNodesLayout = layout;
+		m_wideNodesCount = header.nodesAm;
+		m_wideTreeDepth = header.depth;
+		m_bounds = AABB(glm::vec3(header.bounds[0], header.bounds[1], header.bounds[2]),
+			glm::vec3(header.bounds[3], header.bounds[4], header.bounds[5]));
+		//there are no binary nodes until the next construct
+		m_nodes.clear();
+		m_nodesCount = 0;
+		m_parents.clear();
+		m_isWideTreeDirty = false;
+		return true;
+	}
+
+	void BVH::saveCache(const std::string& path, ::uint64_t hash,
+		const std::vector<Primitive*>& primitives) const
+	{
+		//leaf order as indices into the primitives given to construct
+		typedef std::pair<const Primitive *, int> InputIndex;
+		auto byPointer = [](const InputIndex& a, const InputIndex& b) {
+			return std::less<const Primitive *>()(a.first, b.first);
+		};
+		std::vector<InputIndex> inputIndices(primitives.size());
+		for (int i = 0; i < static_cast<int>(primitives.size()); ++i) {
+			inputIndices[i] = InputIndex(primitives[i], i);
+		}
+		std::sort(inputIndices.begin(), inputIndices.end(), byPointer);
+		std::vector<int> order(m_leafPrimitives.size());
+		concurrency::parallel_for(0, static_cast<int>(order.size()), 1, [&](int i) {
+			order[i] = std::lower_bound(inputIndices.begin(), inputIndices.end(),
+				InputIndex(m_leafPrimitives[i], 0), byPointer)->second;
+		});
+
+		CacheHeader header;
+		memcpy(header.magic, "AGRB", 4);
+		header.version = CACHE_VERSION;
+		header.hash = hash;
+		header.nodeLayout = m_wideNodesLayout;
+		header.nodeSize = static_cast<::uint32_t>(getNodeSize(m_wideNodesLayout));
+		header.primitivesAm = static_cast<int>(primitives.size());
+		header.leafReferencesAm = static_cast<int>(order.size());
+		header.nodesAm = m_wideNodesCount;
+		header.depth = m_wideTreeDepth;
+		for (int i = 0; i < 3; ++i) {
+			header.bounds[i] = m_bounds.getMinPt()[i];
+			header.bounds[i + 3] = m_bounds.getMaxPt()[i];
+		}
+		size_t orderOffset, nodesOffset;
+		calcCacheLayout(header.leafReferencesAm, orderOffset, nodesOffset);
+
+		//written aside and renamed, processes that mapped the old file keep it
+		std::string tmpPath = path + ".tmp";
+		{
+			std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+			if (!out) return;
+			const char padding[CACHE_ALIGNMENT] = {};
+			out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+			out.write(padding, orderOffset - sizeof(header));
+			out.write(reinterpret_cast<const char *>(order.data()), sizeof(int) * order.size());
+			out.write(padding, nodesOffset - orderOffset - sizeof(int) * order.size());
+			out.write(m_wideNodesData, header.nodeSize * m_wideNodesCount);
+			if (!out) {
+				out.close();
+				std::remove(tmpPath.c_str());
+				return;
+			}
+		}
+		std::remove(path.c_str());
+		if (std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+			std::remove(tmpPath.c_str());
+		}
+	}
+
+	void BVH::refit()
+	{
+		//primitives moved but the set is the same, keep the topology
+		if (m_nodesCount == 0) {
+			//loaded from a cache, only the wide nodes are there to refit
+			m_bounds = refitWideNodes();
+			return;
+		}
+		float cost = calcCost(0, 0, true) / m_nodes[0].bounds.calcArea();
+		if (cost > m_builtCost * m_refitThreshold) {
+			std::vector<Primitive *> primitives = m_primitives;
+			construct(primitives);
+			return;
+		}
+		if (m_isWideTreeDirty) {
+			collapseTree();
+		} else {
+			m_bounds = refitWideNodes();
+		}
+	}
+
+	void BVH::insert(Primitive *primitive)
+	{
+		if (m_primitives.size() < 2 || m_nodesCount == 0) {
+			std::vector<Primitive *> primitives = m_primitives;
+			primitives.push_back(primitive);
+			construct(primitives);
+			return;
+		}
+		prepareUpdates();
+		int leaf = allocateNode();
+		m_nodes[leaf].bounds = primitive->getBoundingBox();
+		m_nodes[leaf].primitiveNum = static_cast<int>(m_primitives.size());
+		m_nodes[leaf].isLeaf = Node::LEAF_FLAG;
+		m_primitives.push_back(primitive);
+
+		int sibling = findBestSibling(m_nodes[leaf].bounds);
+		int node = allocateNode();
+		if (sibling == 0) {
+			//the root has to stay the first node, move it down instead
+			m_nodes[node] = m_nodes[0];
+			if (!(m_nodes[node].isLeaf & Node::LEAF_FLAG)) {
+				m_parents[m_nodes[node].left] = node;
+				m_parents[m_nodes[node].right] = node;
+			}
+			sibling = node;
+			node = 0;
+		} else {
+			int parent = m_parents[sibling];
+			if (m_nodes[parent].left == sibling) {
+				m_nodes[parent].left = node;
+			} else {
+				m_nodes[parent].right = node;
+			}
+			m_parents[node] = parent;
+		}
+		m_nodes[node].left = sibling;
+		m_nodes[node].right = leaf;
+		m_parents[sibling] = node;
+		m_parents[leaf] = node;
+		updateAncestors(node);
+		m_isWideTreeDirty = true;
+	}
+
+	bool BVH::remove(Primitive *primitive)
+	{
+		//spatial splits may reference a primitive from several leaves and trees
+		//loaded from a cache have no binary nodes, such trees and the smallest
+		//ones are rebuilt instead
+		bool hasDuplicates = (m_nodesCount + 1) / 2 > static_cast<int>(m_primitives.size());
+		if (m_primitives.size() <= 2 || hasDuplicates || m_nodesCount == 0) {
+			std::vector<Primitive *> primitives = m_primitives;
+			auto it = std::find(primitives.begin(), primitives.end(), primitive);
+			if (it == primitives.end()) return false;
+			primitives.erase(it);
+			construct(primitives);
+			return true;
+		}
+		prepareUpdates();
+		int leaf = findLeaf(primitive);
+		if (leaf < 0) return false;
+		int primitiveNum = m_nodes[leaf].primitiveNum;
+		removeLeaf(leaf);
+		//keep the primitives dense, the last one takes the freed slot
+		int last = static_cast<int>(m_primitives.size()) - 1;
+		if (primitiveNum != last) {
+			m_nodes[findLeaf(m_primitives[last])].primitiveNum = primitiveNum;
+			m_primitives[primitiveNum] = m_primitives[last];
+		}
+		m_primitives.pop_back();
+		m_isWideTreeDirty = true;
+		return true;
+	}
+
+	bool BVH::commitUpdates()
+	{
+		if (!m_isWideTreeDirty) return false;
+		float cost = calcCost(0, 0, false) / m_nodes[0].bounds.calcArea();
+		if (cost > m_builtCost * m_refitThreshold) {
+			std::vector<Primitive *> primitives = m_primitives;
+			construct(primitives);
+		} else {
+			collapseTree();
+		}
+		return true;
+	}
+
+	void BVH::prepareUpdates()
+	{
+		int nodesAm = m_nodesCount;
+		if (m_parents.size() == nodesAm) return;
+		m_parents.resize(nodesAm);
+		m_parents[0] = -1;
+		concurrency::parallel_for(0, nodesAm, 1, [this](int i) {
+			if (!(m_nodes[i].isLeaf & Node::LEAF_FLAG)) {
+				m_parents[m_nodes[i].left] = i;
+				m_parents[m_nodes[i].right] = i;
+			}
+		});
+	}
+
+	int BVH::allocateNode()
+	{
+		int nodeNum = m_nodesCount++;
+		if (nodeNum >= static_cast<int>(m_nodes.size())) m_nodes.resize(nodeNum + 1);
+		m_parents.resize(nodeNum + 1);
+		return nodeNum;
+	}
+
+	void BVH::freeNode(int nodeNum)
+	{
+		//the last node takes the freed slot so the used nodes stay contiguous
+		int last = --m_nodesCount;
+		if (nodeNum != last) {
+			m_nodes[nodeNum] = m_nodes[last];
+			int parent = m_parents[last];
+			m_parents[nodeNum] = parent;
+			if (m_nodes[parent].left == last) {
+				m_nodes[parent].left = nodeNum;
+			} else {
+				m_nodes[parent].right = nodeNum;
+			}
+			if (!(m_nodes[nodeNum].isLeaf & Node::LEAF_FLAG)) {
+				m_parents[m_nodes[nodeNum].left] = nodeNum;
+				m_parents[m_nodes[nodeNum].right] = nodeNum;
+			}
+		}
+		m_parents.pop_back();
+	}
+
+	int BVH::findBestSibling(const AABB& bounds) const
+	{
+		//branch and bound over the cost of the nodes enlarged on the way down,
+		//"Incremental BVH construction for ray tracing", Bittner et al.
+		typedef std::pair<float, int> Candidate;
+		std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> queue;
+		float area = bounds.calcArea();
+		int best = 0;
+		float bestCost = FLT_MAX;
+		queue.push(Candidate(0.0f, 0));
+		while (!queue.empty()) {
+			float inducedCost = queue.top().first;
+			int nodeNum = queue.top().second;
+			queue.pop();
+			if (inducedCost + area >= bestCost) break;
+			const Node& node = m_nodes[nodeNum];
+			AABB merged = node.bounds;
+			merged.extend(bounds);
+			float directCost = merged.calcArea();
+			if (inducedCost + directCost < bestCost) {
+				bestCost = inducedCost + directCost;
+				best = nodeNum;
+			}
+			if (node.isLeaf & Node::LEAF_FLAG) continue;
+			float childCost = inducedCost + directCost - node.bounds.calcArea();
+			if (childCost + area < bestCost) {
+				queue.push(Candidate(childCost, node.left));
+				queue.push(Candidate(childCost, node.right));
+			}
+		}
+		return best;
+	}
+
+	int BVH::findLeaf(const Primitive *primitive) const
+	{
+		const AABB& bounds = primitive->getBoundingBox();
+		std::vector<int> stack(1, 0);
+		while (!stack.empty()) {
+			const Node& node = m_nodes[stack.back()];
+			int nodeNum = stack.back();
+			stack.pop_back();
+			if (!node.bounds.testOverlap(bounds)) continue;
+			if (node.isLeaf & Node::LEAF_FLAG) {
+				if (m_primitives[node.primitiveNum] == primitive) return nodeNum;
+			} else {
+				stack.push_back(node.left);
+				stack.push_back(node.right);
+			}
+		}
+		//the primitive moved since the last refit
+		int nodesAm = m_nodesCount;
+		for (int i = 0; i < nodesAm; ++i) {
+			if ((m_nodes[i].isLeaf & Node::LEAF_FLAG) &&
+				m_primitives[m_nodes[i].primitiveNum] == primitive) return i;
+		}
+		return -1;
+	}
+
+	void BVH::removeLeaf(int leaf)
+	{
+		int parent = m_parents[leaf];
+		int sibling = m_nodes[parent].left == leaf ? m_nodes[parent].right : m_nodes[parent].left;
+		int freed = sibling;
+		if (parent == 0) {
+			m_nodes[0] = m_nodes[sibling];
+			if (!(m_nodes[0].isLeaf & Node::LEAF_FLAG)) {
+				m_parents[m_nodes[0].left] = 0;
+				m_parents[m_nodes[0].right] = 0;
+			}
+		} else {
+			int grandparent = m_parents[parent];
+			if (m_nodes[grandparent].left == parent) {
+				m_nodes[grandparent].left = sibling;
+			} else {
+				m_nodes[grandparent].right = sibling;
+			}
+			m_parents[sibling] = grandparent;
+			updateAncestors(grandparent);
+			freed = parent;
+		}
+		//higher index first, so the second one is never the moved last node
+		freeNode(std::max(leaf, freed));
+		freeNode(std::min(leaf, freed));
+	}
+
+	void BVH::updateAncestors(int nodeNum)
+	{
+		while (nodeNum >= 0) {
+			rotateNode(nodeNum);
+			Node& node = m_nodes[nodeNum];
+			node.bounds = m_nodes[node.left].bounds;
+			node.bounds.extend(m_nodes[node.right].bounds);
+			nodeNum = m_parents[nodeNum];
+		}
+	}
+
+	void BVH::rotateNode(int nodeNum)
+	{
+		//swaps a child with a grandchild from the other side when that shrinks
+		//the other child, "Fast, effective BVH updates for animated scenes", Kopta et al.
+		Node& node = m_nodes[nodeNum];
+		int bestChild = -1;
+		int bestGrandchild = -1;
+		float bestGain = 0.0f;
+		int children[2] = { node.left, node.right };
+		for (int side = 0; side < 2; ++side) {
+			const Node& other = m_nodes[children[1 - side]];
+			if (other.isLeaf & Node::LEAF_FLAG) continue;
+			int grandchildren[2] = { other.left, other.right };
+			for (int i = 0; i < 2; ++i) {
+				AABB rotated = m_nodes[children[side]].bounds;
+				rotated.extend(m_nodes[grandchildren[1 - i]].bounds);
+				float gain = other.bounds.calcArea() - rotated.calcArea();
+				if (gain > bestGain) {
+					bestGain = gain;
+					bestChild = side;
+					bestGrandchild = i;
+				}
+			}
+		}
+		if (bestChild < 0) return;
+		int child = children[bestChild];
+		int otherNum = children[1 - bestChild];
+		Node& other = m_nodes[otherNum];
+		int& grandchild = bestGrandchild == 0 ? other.left : other.right;
+		if (bestChild == 0) {
+			node.left = grandchild;
+		} else {
+			node.right = grandchild;
+		}
+		m_parents[grandchild] = nodeNum;
+		grandchild = child;
+		m_parents[child] = otherNum;
+		other.bounds = m_nodes[other.left].bounds;
+		other.bounds.extend(m_nodes[other.right].bounds);
+	}
+
+	float BVH::calcCost(int nodeNum, int depth, bool refit)
+	{
+		Node& node = m_nodes[nodeNum];
+		if (node.isLeaf & Node::LEAF_FLAG) {
+			if (refit) node.bounds = m_primitives[node.primitiveNum]->getBoundingBox();
+			return SAH_PRIMITIVE_COST * node.bounds.calcArea();
+		}
+		float leftCost, rightCost;
+		if (depth < PARALLEL_DEPTH) {
+			concurrency::parallel_invoke(
+				[&] { leftCost = calcCost(node.left, depth + 1, refit); },
+				[&] { rightCost = calcCost(node.right, depth + 1, refit); });
+		} else {
+			leftCost = calcCost(node.left, depth + 1, refit);
+			rightCost = calcCost(node.right, depth + 1, refit);
+		}
+		if (refit) {
+			node.bounds = m_nodes[node.left].bounds;
+			node.bounds.extend(m_nodes[node.right].bounds);
+		}
+		return SAH_NODE_COST * node.bounds.calcArea() + leftCost + rightCost;
+	}
+
+	AABB BVH::refitWideNodes()
+	{
+		switch (m_wideNodesLayout) {
+		case OCT_NODES:
+			return refitWideNode(getWideNodes<OctNode>(), 0, 0);
+		case COMPRESSED_QUAD_NODES:
+			return refitWideNode(getWideNodes<CompressedQuadNode>(), 0, 0);
+		case COMPRESSED_OCT_NODES:
+			return refitWideNode(getWideNodes<CompressedOctNode>(), 0, 0);
+		default:
+			return refitWideNode(getWideNodes<QuadNode>(), 0, 0);
+		}
+	}
+
+	template<class WideNode>
+	AABB BVH::refitWideNode(WideNode *nodes, int nodeNum, int depth)
+	{
+		WideNode& node = nodes[nodeNum];
+		//children are packed to the front, empty slots have no child
+		int count = 0;
+		while (count < WideNode::WIDTH && node.child[count] != 0) ++count;
+		AABB children[WideNode::WIDTH];
+		auto refitChild = [&](int i) {
+			if (node.isLeaf[i] & WideNode::LEAF_FLAG) {
+				children[i] = refitLeaf(node.child[i]);
+			} else {
+				children[i] = refitWideNode(nodes, node.child[i], depth + 1);
+			}
+		};
+		if (depth < PARALLEL_DEPTH / 2) {
+			concurrency::parallel_for(0, count, 1, refitChild);
+		} else {
+			for (int i = 0; i < count; ++i) refitChild(i);
+		}
+		node.setBounds(children, count);
+		AABB result = AABB::empty();
+		for (int i = 0; i < count; ++i) {
+			result.extend(children[i]);
+		}
+		return result;
+	}
+
+	void BVH::createLeafNodes()
+	{
 		m_nodes.resize(m_primitives.size() * 2);
-		m_nodesCount = 1;
+		concurrency::parallel_for(0, static_cast<int>(m_primitives.size()), 1, [this](int i) {
+			m_nodes[i + 1].primitiveNum = i;
+			m_nodes[i + 1].bounds = m_primitives[i]->getBoundingBox();
+			m_nodes[i + 1].isLeaf = Node::LEAF_FLAG;
+		});
+		m_nodesCount = static_cast<int>(m_primitives.size()) + 1;
+	}
+
+	void BVH::constructAgglomerative()
+	{
+		sortPrimitivesByMortonCodes();
+		createLeafNodes();
 		std::vector<NodePair> nodes(m_primitives.size());
 		for (int i = 0; i < m_primitives.size(); ++i) {
 			nodes[i] = { i + 1, nullptr, FLT_MAX };
-			m_nodes[m_nodesCount].primitiveNum = i;
-			m_nodes[m_nodesCount].bounds = m_primitives[i]->getBoundingBox();
-			m_nodes[m_nodesCount].isLeaf |= Node::LEAF_FLAG;
-			++m_nodesCount;
 		}
 		int newSize = BuildTreeAgglomerative(&nodes[0], static_cast<int>(m_primitives.size()));
 		int curPos = 0;
@@ -30,65 +744,825 @@ namespace AGR
 		}
 		combineClusters(&nodes[0], newSize, 1);
 		m_nodes[0] = m_nodes[--m_nodesCount];
-		m_quadNodes.resize(m_nodes.size());
-		m_quadNodesCount = 1;
-		Node *initialChildren[4];
-		formQuadNode(&m_nodes[0], initialChildren);
-		buildQuadTree(&m_quadNodes[0], initialChildren);
 	}
 
-	bool BVH::Traverse(Ray& ray, Intersection& intersect, float minLength)
+	void BVH::constructPLOC()
+	{
+		sortPrimitivesByMortonCodes();
+		createLeafNodes();
+		int size = static_cast<int>(m_primitives.size());
+		std::vector<int> clusters(size);
+		std::vector<int> nextClusters(size);
+		std::vector<int> neighbours(size);
+		for (int i = 0; i < size; ++i) {
+			clusters[i] = i + 1;
+		}
+		const int chunksAm = 64;
+		int chunkOffsets[chunksAm + 1];
+		while (size > 1) {
+			//nearest neighbour inside the window along the Morton curve,
+			//ties go to the lower index so the closest pair is always mutual
+			concurrency::parallel_for(0, size, 1, [this, &clusters, &neighbours, size](int i) {
+				const AABB& bounds = m_nodes[clusters[i]].bounds;
+				int from = i > PLOC_RADIUS ? i - PLOC_RADIUS : 0;
+				int to = i + PLOC_RADIUS < size - 1 ? i + PLOC_RADIUS : size - 1;
+				float bestDist = FLT_MAX;
+				int best = i;
+				for (int j = from; j <= to; ++j) {
+					if (j == i) continue;
+					AABB united = bounds;
+					united.extend(m_nodes[clusters[j]].bounds);
+					float dist = united.calcArea();
+					if (dist < bestDist) {
+						bestDist = dist;
+						best = j;
+					}
+				}
+				neighbours[i] = best;
+			});
+
+			//mutual neighbours are merged into the slot of the left one,
+			//the right one disappears and the rest is compacted in order
+			auto survives = [&neighbours](int i) {
+				return neighbours[neighbours[i]] != i || i < neighbours[i];
+			};
+			int chunkSize = size / chunksAm + 1;
+			concurrency::parallel_for(0, chunksAm, 1, [&](int iter) {
+				int from = chunkSize * iter;
+				int to = from + chunkSize < size ? from + chunkSize : size;
+				int count = 0;
+				for (int i = from; i < to; ++i) {
+					count += survives(i);
+				}
+				chunkOffsets[iter + 1] = count;
+			});
+			chunkOffsets[0] = 0;
+			for (int iter = 0; iter < chunksAm; ++iter) {
+				chunkOffsets[iter + 1] += chunkOffsets[iter];
+			}
+			concurrency::parallel_for(0, chunksAm, 1, [&](int iter) {
+				int from = chunkSize * iter;
+				int to = from + chunkSize < size ? from + chunkSize : size;
+				int pos = chunkOffsets[iter];
+				for (int i = from; i < to; ++i) {
+					if (!survives(i)) continue;
+					if (neighbours[neighbours[i]] != i) {
+						nextClusters[pos++] = clusters[i];
+						continue;
+					}
+					int newNode = m_nodesCount++;
+					Node& node = m_nodes[newNode];
+					node.left = clusters[i];
+					node.right = clusters[neighbours[i]];
+					node.bounds = m_nodes[node.left].bounds;
+					node.bounds.extend(m_nodes[node.right].bounds);
+					nextClusters[pos++] = newNode;
+				}
+			});
+			clusters.swap(nextClusters);
+			size = chunkOffsets[chunksAm];
+		}
+		m_nodes[0] = m_nodes[--m_nodesCount];
+	}
+
+	void BVH::constructLBVH()
+	{
+		sortPrimitivesByMortonCodes();
+		int size = static_cast<int>(m_primitives.size());
+		int internalAm = size - 1;
+		m_nodes.resize(size * 2);
+		m_nodesCount = internalAm + size;
+		//internal nodes occupy [0, size - 1), leaves follow in Morton order
+		std::vector<int> parents(internalAm + size);
+		concurrency::parallel_for(0, size, 1, [this, internalAm](int i) {
+			Node& leaf = m_nodes[internalAm + i];
+			leaf.primitiveNum = i;
+			leaf.bounds = m_primitives[i]->getBoundingBox();
+			leaf.isLeaf = Node::LEAF_FLAG;
+		});
+		concurrency::parallel_for(0, internalAm, 1, [this, &parents, internalAm](int i) {
+			//direction of the range covered by the node
+			int d = commonPrefix(i, i + 1) > commonPrefix(i, i - 1) ? 1 : -1;
+			int minPrefix = commonPrefix(i, i - d);
+			int maxLen = 2;
+			while (commonPrefix(i, i + maxLen * d) > minPrefix) maxLen <<= 1;
+			int len = 0;
+			for (int t = maxLen >> 1; t > 0; t >>= 1) {
+				if (commonPrefix(i, i + (len + t) * d) > minPrefix) len += t;
+			}
+			int j = i + len * d;
+			//split position, same search as findSplit but inside the range
+			int nodePrefix = commonPrefix(i, j);
+			int split = 0;
+			int step = len;
+			do {
+				step = (step + 1) >> 1;
+				if (commonPrefix(i, i + (split + step) * d) > nodePrefix) split += step;
+			} while (step > 1);
+			int gamma = i + split * d + (d < 0 ? -1 : 0);
+			int left = (i < j ? i : j) == gamma ? internalAm + gamma : gamma;
+			int right = (i > j ? i : j) == gamma + 1 ? internalAm + gamma + 1 : gamma + 1;
+			m_nodes[i].left = left;
+			m_nodes[i].right = right;
+			parents[left] = i;
+			parents[right] = i;
+		});
+
+		//bottom-up bounds, the second child to arrive at a node finishes it
+		std::unique_ptr<std::atomic<int>[]> visits(new std::atomic<int>[size]);
+		for (int i = 0; i < internalAm; ++i) {
+			visits[i] = 0;
+		}
+		concurrency::parallel_for(0, size, 1, [this, &parents, &visits, internalAm](int i) {
+			int node = internalAm + i;
+			while (node != 0) {
+				node = parents[node];
+				if (visits[node].fetch_add(1) == 0) return;
+				m_nodes[node].bounds = m_nodes[m_nodes[node].left].bounds;
+				m_nodes[node].bounds.extend(m_nodes[m_nodes[node].right].bounds);
+			}
+		});
+	}
+
+	int BVH::commonPrefix(int i, int j) const
+	{
+		if (j < 0 || j >= static_cast<int>(m_mortonCodes.size())) return -1;
+		::uint64_t first = m_mortonCodes[i];
+		::uint64_t second = m_mortonCodes[j];
+		//equal codes are told apart by their position in the sorted order
+		if (first == second) return 64 + lzcnt32(static_cast<::uint32_t>(i ^ j));
+		return lzcnt64(first ^ second);
+	}
+
+	void BVH::optimizeTreelets()
+	{
+		int nodesAm = m_nodesCount;
+		std::vector<int> parents(nodesAm);
+		std::vector<float> costs(nodesAm);
+		std::vector<int> primitivesAm(nodesAm);
+		std::unique_ptr<std::atomic<int>[]> visits(new std::atomic<int>[nodesAm]);
+		parents[0] = -1;
+		concurrency::parallel_for(0, nodesAm, 1, [&](int i) {
+			visits[i] = 0;
+			if (!(m_nodes[i].isLeaf & Node::LEAF_FLAG)) {
+				parents[m_nodes[i].left] = i;
+				parents[m_nodes[i].right] = i;
+			}
+		});
+		//bottom-up walk, a node is processed once both of its subtrees are done,
+		//so restructuring never touches nodes another thread is working on
+		concurrency::parallel_for(0, nodesAm, 1, [&](int i) {
+			if (!(m_nodes[i].isLeaf & Node::LEAF_FLAG)) return;
+			costs[i] = SAH_PRIMITIVE_COST * m_nodes[i].bounds.calcArea();
+			primitivesAm[i] = 1;
+			int node = i;
+			while (node != 0) {
+				node = parents[node];
+				if (visits[node].fetch_add(1) == 0) return;
+				int left = m_nodes[node].left;
+				int right = m_nodes[node].right;
+				primitivesAm[node] = primitivesAm[left] + primitivesAm[right];
+				costs[node] = SAH_NODE_COST * m_nodes[node].bounds.calcArea() +
+					costs[left] + costs[right];
+				if (primitivesAm[node] >= TREELET_SIZE) {
+					restructureTreelet(node, parents, costs);
+				}
+			}
+		});
+	}
+
+	void BVH::restructureTreelet(int root, std::vector<int>& parents, std::vector<float>& costs)
+	{
+		//grow the treelet by opening the leaf with the largest surface area
+		int leaves[TREELET_SIZE];
+		int internals[TREELET_SIZE - 2];
+		int leavesAm = 2;
+		int internalsAm = 0;
+		leaves[0] = m_nodes[root].left;
+		leaves[1] = m_nodes[root].right;
+		while (leavesAm < TREELET_SIZE) {
+			int largest = -1;
+			float largestArea = -1.0f;
+			for (int i = 0; i < leavesAm; ++i) {
+				if (m_nodes[leaves[i]].isLeaf & Node::LEAF_FLAG) continue;
+				float area = m_nodes[leaves[i]].bounds.calcArea();
+				if (area > largestArea) {
+					largestArea = area;
+					largest = i;
+				}
+			}
+			if (largest < 0) break;
+			int opened = leaves[largest];
+			internals[internalsAm++] = opened;
+			leaves[largest] = m_nodes[opened].left;
+			leaves[leavesAm++] = m_nodes[opened].right;
+		}
+		if (leavesAm < 3) return;
+
+		//optimal topology for every subset of the treelet leaves
+		const int subsetsAm = 1 << TREELET_SIZE;
+		AABB bounds[subsetsAm];
+		float optimalCost[subsetsAm];
+		int optimalSplit[subsetsAm];
+		int fullSet = (1 << leavesAm) - 1;
+		for (int set = 1; set <= fullSet; ++set) {
+			int lowest = set & -set;
+			int rest = set ^ lowest;
+			if (rest == 0) {
+				int leaf = leaves[31 - lzcnt32(lowest)];
+				bounds[set] = m_nodes[leaf].bounds;
+				optimalCost[set] = costs[leaf];
+				continue;
+			}
+			bounds[set] = bounds[rest];
+			bounds[set].extend(bounds[lowest]);
+			//the lowest leaf always goes left, which visits every split once
+			float best = FLT_MAX;
+			for (int part = rest; ; part = (part - 1) & rest) {
+				int left = part | lowest;
+				if (left != set) {
+					float cost = optimalCost[left] + optimalCost[set ^ left];
+					if (cost < best) {
+						best = cost;
+						optimalSplit[set] = left;
+					}
+				}
+				if (part == 0) break;
+			}
+			optimalCost[set] = SAH_NODE_COST * bounds[set].calcArea() + best;
+		}
+		if (optimalCost[fullSet] >= costs[root] * (1.0f - FLT_EPSILON)) return;
+
+		//rebuild the treelet reusing its internal nodes
+		int stack[TREELET_SIZE][2];
+		int stackSize = 0;
+		int order[TREELET_SIZE - 1];
+		int orderSize = 0;
+		stack[stackSize][0] = root;
+		stack[stackSize++][1] = fullSet;
+		while (stackSize > 0) {
+			--stackSize;
+			int node = stack[stackSize][0];
+			int set = stack[stackSize][1];
+			order[orderSize++] = node;
+			int split[2] = { optimalSplit[set], set ^ optimalSplit[set] };
+			int children[2];
+			for (int i = 0; i < 2; ++i) {
+				if ((split[i] & (split[i] - 1)) == 0) {
+					children[i] = leaves[31 - lzcnt32(split[i])];
+				} else {
+					children[i] = internals[--internalsAm];
+					stack[stackSize][0] = children[i];
+					stack[stackSize++][1] = split[i];
+				}
+				parents[children[i]] = node;
+			}
+			m_nodes[node].left = children[0];
+			m_nodes[node].right = children[1];
+		}
+		//parents were emitted before their children, refresh bottom-up
+		for (int i = orderSize - 1; i >= 0; --i) {
+			Node& node = m_nodes[order[i]];
+			node.bounds = m_nodes[node.left].bounds;
+			node.bounds.extend(m_nodes[node.right].bounds);
+			costs[order[i]] = SAH_NODE_COST * node.bounds.calcArea() +
+				costs[node.left] + costs[node.right];
+		}
+	}
+
+	void BVH::constructSBVH()
+	{
+		int size = static_cast<int>(m_primitives.size());
+		std::vector<Reference> refs(size);
+		concurrency::parallel_for(0, size, 1, [this, &refs](int i) {
+			refs[i] = { m_primitives[i]->getBoundingBox(), i };
+		});
+		int extraRefsAm = static_cast<int>(size * m_spatialSplitBudget);
+		m_splitBudget = extraRefsAm;
+		m_nodes.resize((size + extraRefsAm) * 2);
+		m_nodes[0].bounds = reduceBounds(size, [&refs](int i) { return refs[i].bounds; });
+		m_minSplitOverlap = m_nodes[0].bounds.calcArea() * SBVH_OVERLAP_THRESHOLD;
+		m_nodesCount = 1;
+		buildSBVH(0, refs);
+	}
+
+	void BVH::buildSBVH(int nodeNum, std::vector<Reference>& refs)
+	{
+		int size = static_cast<int>(refs.size());
+		if (size == 1) {
+			m_nodes[nodeNum].primitiveNum = refs[0].primitiveNum;
+			m_nodes[nodeNum].isLeaf = Node::LEAF_FLAG;
+			return;
+		}
+		const AABB& nodeBounds = m_nodes[nodeNum].bounds;
+		std::vector<Reference> leftRefs, rightRefs;
+
+		//object split over the reference centroids
+		AABB centers = AABB::empty();
+		for (const Reference& ref : refs) {
+			glm::vec3 c = ref.bounds.getCenter();
+			centers.extend(AABB(c, c));
+		}
+		glm::vec3 centersMin = centers.getMinPt();
+		glm::vec3 centersExtent = centers.getMaxPt() - centersMin;
+		float bestCost = FLT_MAX;
+		int bestAxis = -1;
+		int bestSplit = 0;
+		AABB objectLeft, objectRight;
+		for (int axis = 0; axis < 3; ++axis) {
+			if (centersExtent[axis] <= 0.0f) continue;
+			float scale = SAH_BINS * (1.0f - FLT_EPSILON) / centersExtent[axis];
+			AABB binBounds[SAH_BINS];
+			int binCount[SAH_BINS] = {};
+			for (int i = 0; i < SAH_BINS; ++i) {
+				binBounds[i] = AABB::empty();
+			}
+			for (const Reference& ref : refs) {
+				int bin = static_cast<int>((ref.bounds.getCenter()[axis] - centersMin[axis]) * scale);
+				binBounds[bin].extend(ref.bounds);
+				++binCount[bin];
+			}
+			AABB rightBounds[SAH_BINS];
+			int rightCount[SAH_BINS];
+			AABB acc = AABB::empty();
+			int count = 0;
+			for (int i = SAH_BINS - 1; i > 0; --i) {
+				acc.extend(binBounds[i]);
+				count += binCount[i];
+				rightBounds[i] = acc;
+				rightCount[i] = count;
+			}
+			acc = AABB::empty();
+			count = 0;
+			for (int i = 0; i < SAH_BINS - 1; ++i) {
+				acc.extend(binBounds[i]);
+				count += binCount[i];
+				if (count == 0 || rightCount[i + 1] == 0) continue;
+				float cost = count * acc.calcArea() + rightCount[i + 1] * rightBounds[i + 1].calcArea();
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = i + 1;
+					objectLeft = acc;
+					objectRight = rightBounds[i + 1];
+				}
+			}
+		}
+
+		//spatial split, only tried where the object split children overlap
+		float overlap = 0.0f;
+		if (bestAxis >= 0 && objectLeft.testOverlap(objectRight)) {
+			AABB intersection(glm::max(objectLeft.getMinPt(), objectRight.getMinPt()),
+				glm::min(objectLeft.getMaxPt(), objectRight.getMaxPt()));
+			overlap = intersection.calcArea();
+		}
+		int spatialAxis = -1;
+		float spatialPlane = 0.0f;
+		if ((bestAxis < 0 || overlap > m_minSplitOverlap) && m_splitBudget > 0) {
+			glm::vec3 nodeMin = nodeBounds.getMinPt();
+			glm::vec3 nodeExtent = nodeBounds.getMaxPt() - nodeMin;
+			for (int axis = 0; axis < 3; ++axis) {
+				if (nodeExtent[axis] <= 0.0f) continue;
+				float binWidth = nodeExtent[axis] / SAH_BINS;
+				AABB binBounds[SAH_BINS];
+				int entries[SAH_BINS] = {};
+				int exits[SAH_BINS] = {};
+				for (int i = 0; i < SAH_BINS; ++i) {
+					binBounds[i] = AABB::empty();
+				}
+				for (const Reference& ref : refs) {
+					int first = static_cast<int>((ref.bounds.getMinPt()[axis] - nodeMin[axis]) / binWidth);
+					int last = static_cast<int>((ref.bounds.getMaxPt()[axis] - nodeMin[axis]) / binWidth);
+					first = glm::clamp(first, 0, SAH_BINS - 1);
+					last = glm::clamp(last, first, SAH_BINS - 1);
+					++entries[first];
+					++exits[last];
+					//chop the reference into the bins it passes through
+					AABB rest = ref.bounds;
+					for (int bin = first; bin < last; ++bin) {
+						AABB left, right;
+						m_primitives[ref.primitiveNum]->splitBounds(axis,
+							nodeMin[axis] + binWidth * (bin + 1), rest, left, right);
+						binBounds[bin].extend(left);
+						rest = right;
+					}
+					binBounds[last].extend(rest);
+				}
+				AABB rightBounds[SAH_BINS];
+				int rightCount[SAH_BINS];
+				AABB acc = AABB::empty();
+				int count = 0;
+				for (int i = SAH_BINS - 1; i > 0; --i) {
+					acc.extend(binBounds[i]);
+					count += exits[i];
+					rightBounds[i] = acc;
+					rightCount[i] = count;
+				}
+				acc = AABB::empty();
+				count = 0;
+				for (int i = 0; i < SAH_BINS - 1; ++i) {
+					acc.extend(binBounds[i]);
+					count += entries[i];
+					if (count == 0 || rightCount[i + 1] == 0 ||
+						count == size || rightCount[i + 1] == size ||
+						count + rightCount[i + 1] - size > m_splitBudget) continue;
+					float cost = count * acc.calcArea() + rightCount[i + 1] * rightBounds[i + 1].calcArea();
+					if (cost < bestCost) {
+						bestCost = cost;
+						spatialAxis = axis;
+						spatialPlane = nodeMin[axis] + binWidth * (i + 1);
+					}
+				}
+			}
+		}
+
+		if (spatialAxis >= 0) {
+			for (const Reference& ref : refs) {
+				if (ref.bounds.getMaxPt()[spatialAxis] <= spatialPlane) {
+					leftRefs.push_back(ref);
+				} else if (ref.bounds.getMinPt()[spatialAxis] >= spatialPlane) {
+					rightRefs.push_back(ref);
+				} else {
+					AABB left, right;
+					m_primitives[ref.primitiveNum]->splitBounds(spatialAxis, spatialPlane,
+						ref.bounds, left, right);
+					if (left.getMinPt()[spatialAxis] <= left.getMaxPt()[spatialAxis])
+						leftRefs.push_back({ left, ref.primitiveNum });
+					if (right.getMinPt()[spatialAxis] <= right.getMaxPt()[spatialAxis])
+						rightRefs.push_back({ right, ref.primitiveNum });
+				}
+			}
+			int leftAm = static_cast<int>(leftRefs.size());
+			int rightAm = static_cast<int>(rightRefs.size());
+			int duplicates = leftAm + rightAm - size;
+			bool rejected = leftAm == size || rightAm == size;
+			if (!rejected && m_splitBudget.fetch_sub(duplicates) < duplicates) {
+				m_splitBudget += duplicates;
+				rejected = true;
+			}
+			if (rejected) {
+				//fall back to the object split
+				spatialAxis = -1;
+				leftRefs.clear();
+				rightRefs.clear();
+			}
+		}
+		if (spatialAxis < 0) {
+			if (bestAxis >= 0) {
+				float scale = SAH_BINS * (1.0f - FLT_EPSILON) / centersExtent[bestAxis];
+				for (const Reference& ref : refs) {
+					int bin = static_cast<int>((ref.bounds.getCenter()[bestAxis] - centersMin[bestAxis]) * scale);
+					(bin < bestSplit ? leftRefs : rightRefs).push_back(ref);
+				}
+			} else {
+				leftRefs.assign(refs.begin(), refs.begin() + size / 2);
+				rightRefs.assign(refs.begin() + size / 2, refs.end());
+			}
+		}
+		std::vector<Reference>().swap(refs);
+
+		int left = m_nodesCount.fetch_add(2);
+		m_nodes[nodeNum].left = left;
+		m_nodes[nodeNum].right = left + 1;
+		m_nodes[left].bounds = AABB::empty();
+		m_nodes[left + 1].bounds = AABB::empty();
+		for (const Reference& ref : leftRefs) {
+			m_nodes[left].bounds.extend(ref.bounds);
+		}
+		for (const Reference& ref : rightRefs) {
+			m_nodes[left + 1].bounds.extend(ref.bounds);
+		}
+		if (size > SAH_PARALLEL_THRESHOLD) {
+			concurrency::parallel_invoke(
+				[&] { buildSBVH(left, leftRefs); },
+				[&] { buildSBVH(left + 1, rightRefs); });
+		} else {
+			buildSBVH(left, leftRefs);
+			buildSBVH(left + 1, rightRefs);
+		}
+	}
+
+	void BVH::constructBinnedSAH()
+	{
+		int size = static_cast<int>(m_primitives.size());
+		m_nodes.resize(size * 2);
+		m_primBounds.resize(size);
+		m_primCenters.resize(size);
+		std::vector<int> indices(size);
+		concurrency::parallel_for(0, size, 1, [this, &indices](int i) {
+			indices[i] = i;
+			m_primBounds[i] = m_primitives[i]->getBoundingBox();
+			m_primCenters[i] = m_primBounds[i].getCenter();
+		});
+		AABB centers = reduceBounds(size, [this](int i) {
+			return AABB(m_primCenters[i], m_primCenters[i]);
+		});
+		m_nodes[0].bounds = reduceBounds(size, [this](int i) { return m_primBounds[i]; });
+		m_nodesCount = 1;
+		buildBinnedSAH(0, &indices[0], 0, size, centers);
+
+		//leaves reference primitives by their position in the partitioned
+		//index array, so the primitives are stored in the leaf order
+		std::vector<Primitive *> ordered(size);
+		for (int i = 0; i < size; ++i) {
+			ordered[i] = m_primitives[indices[i]];
+		}
+		m_primitives.swap(ordered);
+	}
+
+	void BVH::buildBinnedSAH(int nodeNum, int* indices, int first, int size, const AABB& centers)
+	{
+		if (size == 1) {
+			m_nodes[nodeNum].primitiveNum = first;
+			m_nodes[nodeNum].isLeaf = Node::LEAF_FLAG;
+			return;
+		}
+		int *begin = indices + first;
+		Bin bins[3 * SAH_BINS];
+		fillBins(begin, size, centers, bins);
+
+		//sweep the bins from both sides to find the cheapest split plane
+		float bestCost = FLT_MAX;
+		int bestAxis = -1;
+		int bestSplit = 0;
+		glm::vec3 extent = centers.getMaxPt() - centers.getMinPt();
+		for (int axis = 0; axis < 3; ++axis) {
+			if (extent[axis] <= 0.0f) continue;
+			float rightArea[SAH_BINS];
+			int rightCount[SAH_BINS];
+			const Bin *axisBins = &bins[axis * SAH_BINS];
+			AABB acc = AABB::empty();
+			int count = 0;
+			for (int i = SAH_BINS - 1; i > 0; --i) {
+				acc.extend(axisBins[i].bounds);
+				count += axisBins[i].count;
+				rightArea[i] = acc.calcArea();
+				rightCount[i] = count;
+			}
+			acc = AABB::empty();
+			count = 0;
+			for (int i = 0; i < SAH_BINS - 1; ++i) {
+				acc.extend(axisBins[i].bounds);
+				count += axisBins[i].count;
+				if (count == 0 || rightCount[i + 1] == 0) continue;
+				float cost = count * acc.calcArea() + rightCount[i + 1] * rightArea[i + 1];
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = i + 1;
+				}
+			}
+		}
+
+		AABB leftBounds, rightBounds, leftCenters, rightCenters;
+		int split;
+		if (bestAxis >= 0) {
+			leftBounds = leftCenters = AABB::empty();
+			rightBounds = rightCenters = AABB::empty();
+			for (int i = 0; i < SAH_BINS; ++i) {
+				const Bin& b = bins[bestAxis * SAH_BINS + i];
+				if (b.count == 0) continue;
+				(i < bestSplit ? leftBounds : rightBounds).extend(b.bounds);
+				(i < bestSplit ? leftCenters : rightCenters).extend(b.centers);
+			}
+			float axisMin = centers.getMinPt()[bestAxis];
+			float scale = SAH_BINS * (1.0f - FLT_EPSILON) / extent[bestAxis];
+			int *mid = std::partition(begin, begin + size, [&](int idx) {
+				int bin = static_cast<int>((m_primCenters[idx][bestAxis] - axisMin) * scale);
+				return bin < bestSplit;
+			});
+			split = static_cast<int>(mid - begin);
+		} else {
+			//all centroids coincide, any partition is as good as the other
+			split = size / 2;
+			leftBounds = leftCenters = rightBounds = rightCenters = AABB::empty();
+			for (int i = 0; i < size; ++i) {
+				(i < split ? leftBounds : rightBounds).extend(m_primBounds[begin[i]]);
+				(i < split ? leftCenters : rightCenters).extend(
+					AABB(m_primCenters[begin[i]], m_primCenters[begin[i]]));
+			}
+		}
+
+		int left = m_nodesCount.fetch_add(2);
+		m_nodes[nodeNum].left = left;
+		m_nodes[nodeNum].right = left + 1;
+		m_nodes[left].bounds = leftBounds;
+		m_nodes[left + 1].bounds = rightBounds;
+		if (size > SAH_PARALLEL_THRESHOLD) {
+			concurrency::parallel_invoke(
+				[&] { buildBinnedSAH(left, indices, first, split, leftCenters); },
+				[&] { buildBinnedSAH(left + 1, indices, first + split, size - split, rightCenters); });
+		} else {
+			buildBinnedSAH(left, indices, first, split, leftCenters);
+			buildBinnedSAH(left + 1, indices, first + split, size - split, rightCenters);
+		}
+	}
+
+	void BVH::fillBins(const int* indices, int size, const AABB& centers, Bin* bins) const
+	{
+		glm::vec3 axisMin = centers.getMinPt();
+		glm::vec3 extent = centers.getMaxPt() - axisMin;
+		glm::vec3 scale;
+		for (int axis = 0; axis < 3; ++axis) {
+			scale[axis] = extent[axis] > 0.0f ? SAH_BINS * (1.0f - FLT_EPSILON) / extent[axis] : 0.0f;
+		}
+		auto binRange = [&](int from, int to, Bin *out) {
+			for (int i = 0; i < 3 * SAH_BINS; ++i) {
+				out[i] = { AABB::empty(), AABB::empty(), 0 };
+			}
+			for (int i = from; i < to; ++i) {
+				const glm::vec3& c = m_primCenters[indices[i]];
+				for (int axis = 0; axis < 3; ++axis) {
+					Bin& b = out[axis * SAH_BINS +
+						static_cast<int>((c[axis] - axisMin[axis]) * scale[axis])];
+					b.bounds.extend(m_primBounds[indices[i]]);
+					b.centers.extend(AABB(c, c));
+					++b.count;
+				}
+			}
+		};
+		if (size <= SAH_PARALLEL_THRESHOLD * 4) {
+			binRange(0, size, bins);
+			return;
+		}
+		//large nodes near the root are binned in chunks and merged afterwards
+		const int chunksAm = 32;
+		std::vector<Bin> partial(chunksAm * 3 * SAH_BINS);
+		concurrency::parallel_for(0, chunksAm, 1, [&](int iter) {
+			int from = ((size / chunksAm) + 1) * iter;
+			int to = ((size / chunksAm) + 1) * (iter + 1);
+			if (to > size) to = size;
+			binRange(from, to, &partial[iter * 3 * SAH_BINS]);
+		});
+		binRange(0, 0, bins);
+		for (int iter = 0; iter < chunksAm; ++iter) {
+			for (int i = 0; i < 3 * SAH_BINS; ++i) {
+				const Bin& b = partial[iter * 3 * SAH_BINS + i];
+				bins[i].bounds.extend(b.bounds);
+				bins[i].centers.extend(b.centers);
+				bins[i].count += b.count;
+			}
+		}
+	}
+
+	void BVH::initRaySIMD(const Ray& ray, const glm::vec3& invDirection, RaySIMD& rsimd)
+	{
+		rsimd.invdirx4 = _mm_set1_ps(invDirection.x);
+		rsimd.invdiry4 = _mm_set1_ps(invDirection.y);
+		rsimd.invdirz4 = _mm_set1_ps(invDirection.z);
+		rsimd.origx4 = _mm_set1_ps(ray.origin.x);
+		rsimd.origy4 = _mm_set1_ps(ray.origin.y);
+		rsimd.origz4 = _mm_set1_ps(ray.origin.z);
+	}
+
+	template<class Query, class Faces>
+	bool BVH::Traverse(const Ray& ray, Intersection& intersect, float length)
 	{
 		intersect.ray_length = -1.0f;
 		glm::vec3 invDirection = 1.0f / ray.direction;
 		float dist;
-		if (!m_nodes[0].bounds.intersect(ray, dist, invDirection)) {
+		if (!m_bounds.intersect(ray, dist, invDirection) || dist >= length) {
 			return false;
 		}
+		if (m_wideNodesLayout == OCT_NODES || m_wideNodesLayout == COMPRESSED_OCT_NODES) {
+			return traverseOct<Query, Faces>(ray, invDirection, intersect, length);
+		}
 		RaySIMD rsimd;
-		rsimd.invdirx4 = _mm_load1_ps(&invDirection.x);
-		rsimd.invdiry4 = _mm_load1_ps(&invDirection.y);
-		rsimd.invdirz4 = _mm_load1_ps(&invDirection.z);
-		rsimd.origx4 = _mm_load1_ps(&ray.origin.x);
-		rsimd.origy4 = _mm_load1_ps(&ray.origin.y);
-		rsimd.origz4 = _mm_load1_ps(&ray.origin.z);
-		return Traverse(ray, rsimd, intersect, &m_quadNodes[0], minLength);
+		initRaySIMD(ray, invDirection, rsimd);
+		if (m_wideNodesLayout == COMPRESSED_QUAD_NODES) {
+			return Traverse<Query, Faces>(ray, rsimd, intersect,
+				getWideNodes<CompressedQuadNode>(), 0, length);
+		}
+		return Traverse<Query, Faces>(ray, rsimd, intersect, getWideNodes<QuadNode>(), 0, length);
+	}
+
+	void BVH::SortedPacketTraverse(std::vector<Ray>& rays, std::vector<Intersection>& intersect)
+	{
+		//"Fast ray sorting and breadth-first packet traversal for GPU ray tracing", Garanzha and Loop
+		int size = static_cast<int>(rays.size());
+		std::vector<::uint64_t> keys(size);
+		std::vector<int> order(size);
+		glm::vec3 boundsMin = m_bounds.getMinPt();
+		glm::vec3 boundsMax = m_bounds.getMaxPt();
+		glm::vec3 directionMin(-1.0f);
+		glm::vec3 directionMax(1.0f);
+		const int directionBits = 3 * RAY_DIRECTION_BITS;
+		concurrency::parallel_for(0, size, 1, [&](int i) {
+			//origins outside the scene fall into its border cells, the top bits
+			//of the direction cell are the octant, so the rays of a packet mostly
+			//agree on the direction signs its frustum needs
+			glm::vec3 origin = rays[i].origin;
+			glm::vec3 direction = rays[i].direction;
+			::uint64_t originCell = CalcMortonCode(origin, boundsMin, boundsMax) >>
+				(MORTON_BITS - 3 * RAY_ORIGIN_BITS);
+			::uint64_t directionCell = CalcMortonCode(direction, directionMin, directionMax) >>
+				(MORTON_BITS - directionBits);
+			keys[i] = (originCell << directionBits) | directionCell;
+			order[i] = i;
+		});
+		radixSort(keys, order, 3 * RAY_ORIGIN_BITS + directionBits);
+		//the packets read the rays and write the hits through the order,
+		//nothing is copied around
+		tracePackets(rays, intersect, order.data());
+	}
+
+	bool BVH::CheckOcclusion(const Ray& ray, float length)
+	{
+		Intersection hit;
+		return Traverse<AnyHit>(ray, hit, length);
 	}
 
 	void BVH::PacketCheckOcclusions(std::vector<Ray>& rays, std::vector<float>& lengths,
 		std::vector<bool>& occlusionFlags)
 	{
+		//vector<bool> packs the flags into shared words, so they are computed
+		//in bytes first and copied once all the chunks are done
+		std::vector<char> flags(rays.size());
 		const int chunksAm = 32;
 		concurrency::parallel_for(0, chunksAm, 1,
-			[this, &rays, &lengths, &occlusionFlags, &chunksAm](int iter) {
+			[this, &rays, &lengths, &flags, &chunksAm](int iter) {
 			int from = ((rays.size() / chunksAm) + 1) * iter;
 			int to = ((rays.size() / chunksAm) + 1) * (iter + 1);
 			if (to > rays.size()) to = rays.size();
 			for (int i = from; i < to; ++i) {
-				Intersection intersect;
-				intersect.ray_length = -1.0f;
-				Traverse(rays[i], intersect, lengths[i]);
-				occlusionFlags[i] = intersect.ray_length > 0 && intersect.ray_length < lengths[i];
+				flags[i] = CheckOcclusion(rays[i], lengths[i]);
 			}
 		});
+		occlusionFlags.assign(flags.begin(), flags.end());
 	}
 
 	void BVH::PacketTraverse(std::vector<Ray>& rays, std::vector<Intersection>& intersect)
+	{
+		tracePackets(rays, intersect, nullptr);
+	}
+
+	void BVH::tracePackets(const std::vector<Ray>& rays, std::vector<Intersection>& intersect,
+		const int *order)
+	{
+		intersect.resize(rays.size());
+		if (!isBuilt()) {
+			for (Intersection& hit : intersect) hit.ray_length = -1.0f;
+			return;
+		}
+		const int chunksAm = 64;
+		concurrency::parallel_for(0, chunksAm, 1,
+			[this, &intersect, &rays, &chunksAm, order](int iter) {
+			int from = ((rays.size() / chunksAm) + 1) * iter;
+			int to = ((rays.size() / chunksAm) + 1) * (iter + 1);
+			if (to > rays.size()) to = rays.size();
+			if (from >= to) return;
+			const int *chunkOrder = order ? order + from : nullptr;
+			const Ray *chunkRays = order ? &rays[0] : &rays[from];
+			Intersection *chunkIntersect = order ? &intersect[0] : &intersect[from];
+			switch (m_wideNodesLayout) {
+			case OCT_NODES:
+			case COMPRESSED_OCT_NODES:
+				tracePacketsOct(chunkRays, chunkIntersect, chunkOrder, to - from);
+				break;
+			case COMPRESSED_QUAD_NODES:
+				PacketTraverse(chunkRays, chunkIntersect, chunkOrder, to - from,
+					getWideNodes<CompressedQuadNode>());
+				break;
+			default:
+				PacketTraverse(chunkRays, chunkIntersect, chunkOrder, to - from,
+					getWideNodes<QuadNode>());
+				break;
+			}
+		});
+	}
+
+	void BVH::InterleavedTraverse(std::vector<Ray>& rays, std::vector<Intersection>& intersect)
 	{
 		intersect.resize(rays.size());
+		if (!isBuilt()) {
+			for (Intersection& hit : intersect) hit.ray_length = -1.0f;
+			return;
+		}
 		const int chunksAm = 64;
 		concurrency::parallel_for(0, chunksAm, 1,
 			[this, &intersect, &rays, &chunksAm](int iter) {
 			int from = ((rays.size() / chunksAm) + 1) * iter;
 			int to = ((rays.size() / chunksAm) + 1) * (iter + 1);
 			if (to > rays.size()) to = rays.size();
-			for (int i = from; i < to; ++i) {
-				Traverse(rays[i], intersect[i], -1.0f);
+			if (from >= to) return;
+			switch (m_wideNodesLayout) {
+			case OCT_NODES:
+			case COMPRESSED_OCT_NODES:
+				traverseInterleavedOct(&rays[from], &intersect[from], to - from);
+				break;
+			case COMPRESSED_QUAD_NODES:
+				InterleavedTraverse(&rays[from], &intersect[from], to - from,
+					getWideNodes<CompressedQuadNode>());
+				break;
+			default:
+				InterleavedTraverse(&rays[from], &intersect[from], to - from,
+					getWideNodes<QuadNode>());
+				break;
 			}
 		});
 	}
 
-	__m128 BVH::QuadNode::intersect(RaySIMD& r, __m128& dist) const
+	int BVH::QuadNode::intersect(const RaySIMD& r, float maxDist, float *dist) const
 	{
 		union {
 			__m128 zero4;
@@ -112,30 +1586,300 @@ namespace AGR
 		__m128 xmax = _mm_max_ps(t1x, t2x);
 		__m128 ymax = _mm_max_ps(t1y, t2y);
 		__m128 zmax = _mm_max_ps(t1z, t2z);
-		dist = _mm_max_ps(_mm_max_ps(xmin, ymin), zmin);
+		__m128 tmin = _mm_max_ps(_mm_max_ps(xmin, ymin), zmin);
 		__m128 tmax = _mm_min_ps(_mm_min_ps(xmax, ymax), zmax);
-		return _mm_and_ps(_mm_cmpgt_ps(tmax, dist), _mm_cmpgt_ps(tmax, zero4));
+		_mm_storeu_ps(dist, tmin);
+		__m128 hit = _mm_and_ps(_mm_cmpgt_ps(tmax, tmin), _mm_cmpgt_ps(tmax, zero4));
+		return _mm_movemask_ps(_mm_and_ps(hit, _mm_cmplt_ps(tmin, _mm_set1_ps(maxDist))));
 	}
 
-	AABB BVH::getSurroundAABB(Primitive** primitives, size_t size) const
+	__m128 BVH::CompressedQuadNode::decode(const unsigned char *q)
 	{
-		if (size == 1) {
-			return primitives[0]->getBoundingBox();
+		int bytes;
+		memcpy(&bytes, q, sizeof(bytes));
+		__m128i zero = _mm_setzero_si128();
+		__m128i ints = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+		return _mm_cvtepi32_ps(ints);
+	}
+
+	int BVH::CompressedQuadNode::intersect(const RaySIMD& r, float maxDist, float *dist) const
+	{
+		//child bounds are decoded on the node grid, the rest is the quad node slab test
+		__m128 scalex = _mm_castsi128_ps(_mm_set1_epi32(exponent[0] << 23));
+		__m128 scaley = _mm_castsi128_ps(_mm_set1_epi32(exponent[1] << 23));
+		__m128 scalez = _mm_castsi128_ps(_mm_set1_epi32(exponent[2] << 23));
+		__m128 originx = _mm_sub_ps(_mm_set1_ps(origin[0]), r.origx4);
+		__m128 originy = _mm_sub_ps(_mm_set1_ps(origin[1]), r.origy4);
+		__m128 originz = _mm_sub_ps(_mm_set1_ps(origin[2]), r.origz4);
+		__m128 t1x = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(decode(qminx), scalex), originx), r.invdirx4);
+		__m128 t1y = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(decode(qminy), scaley), originy), r.invdiry4);
+		__m128 t1z = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(decode(qminz), scalez), originz), r.invdirz4);
+		__m128 t2x = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(decode(qmaxx), scalex), originx), r.invdirx4);
+		__m128 t2y = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(decode(qmaxy), scaley), originy), r.invdiry4);
+		__m128 t2z = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(decode(qmaxz), scalez), originz), r.invdirz4);
+		__m128 tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(t1x, t2x), _mm_min_ps(t1y, t2y)),
+			_mm_min_ps(t1z, t2z));
+		__m128 tmax = _mm_min_ps(_mm_min_ps(_mm_max_ps(t1x, t2x), _mm_max_ps(t1y, t2y)),
+			_mm_max_ps(t1z, t2z));
+		_mm_storeu_ps(dist, tmin);
+		__m128 hit = _mm_and_ps(_mm_cmpgt_ps(tmax, tmin), _mm_cmpgt_ps(tmax, _mm_setzero_ps()));
+		return _mm_movemask_ps(_mm_and_ps(hit, _mm_cmplt_ps(tmin, _mm_set1_ps(maxDist))));
+	}
+
+	void BVH::QuadNode::decodeBounds(ChildBounds<4>& bounds) const
+	{
+		memcpy(bounds.min[0], minx, sizeof(minx));
+		memcpy(bounds.min[1], miny, sizeof(miny));
+		memcpy(bounds.min[2], minz, sizeof(minz));
+		memcpy(bounds.max[0], maxx, sizeof(maxx));
+		memcpy(bounds.max[1], maxy, sizeof(maxy));
+		memcpy(bounds.max[2], maxz, sizeof(maxz));
+	}
+
+	void BVH::CompressedQuadNode::decodeBounds(ChildBounds<4>& bounds) const
+	{
+		const unsigned char *qmin[3] = { qminx, qminy, qminz };
+		const unsigned char *qmax[3] = { qmaxx, qmaxy, qmaxz };
+		for (int axis = 0; axis < 3; ++axis) {
+			__m128 scale = _mm_castsi128_ps(_mm_set1_epi32(exponent[axis] << 23));
+			__m128 base = _mm_set1_ps(origin[axis]);
+			_mm_storeu_ps(bounds.min[axis], _mm_add_ps(_mm_mul_ps(decode(qmin[axis]), scale), base));
+			_mm_storeu_ps(bounds.max[axis], _mm_add_ps(_mm_mul_ps(decode(qmax[axis]), scale), base));
+		}
+	}
+
+	void BVH::RayPacket4::init(const Ray *const *r, int count)
+	{
+		union { __m128 v; float f[4]; } orig[3], dir[3], invdir[3];
+		for (int k = 0; k < SIZE; ++k) {
+			const Ray& ray = *r[k < count ? k : 0];
+			for (int axis = 0; axis < 3; ++axis) {
+				orig[axis].f[k] = ray.origin[axis];
+				dir[axis].f[k] = ray.direction[axis];
+				invdir[axis].f[k] = 1.0f / ray.direction[axis];
+			}
+		}
+		dirx4 = dir[0].v;
+		diry4 = dir[1].v;
+		dirz4 = dir[2].v;
+		rays.origx4 = orig[0].v;
+		rays.origy4 = orig[1].v;
+		rays.origz4 = orig[2].v;
+		rays.invdirx4 = invdir[0].v;
+		rays.invdiry4 = invdir[1].v;
+		rays.invdirz4 = invdir[2].v;
+		tmax4 = _mm_set1_ps(FLT_MAX);
+		float sign[3], origLo[3], origHi[3], invdirLo[3], invdirHi[3];
+		hasFrustum = calcPacketFrustum(&orig[0].f[0], &invdir[0].f[0], SIZE,
+			sign, origLo, origHi, invdirLo, invdirHi);
+		for (int axis = 0; axis < 3; ++axis) {
+			nearSide[axis] = sign[axis] < 0.0f;
+			sign4[axis] = _mm_set1_ps(sign[axis]);
+			origLo4[axis] = _mm_set1_ps(origLo[axis]);
+			origHi4[axis] = _mm_set1_ps(origHi[axis]);
+			invdirLo4[axis] = _mm_set1_ps(invdirLo[axis]);
+			invdirHi4[axis] = _mm_set1_ps(invdirHi[axis]);
 		}
-		if (size == 2) {
-			AABB bb = primitives[0]->getBoundingBox();
-			bb.extend(primitives[1]->getBoundingBox());
-			return bb;
+	}
+
+	int BVH::RayPacket4::activeRays(float dist) const
+	{
+		return _mm_movemask_ps(_mm_cmpgt_ps(tmax4, _mm_set1_ps(dist)));
+	}
+
+	int BVH::RayPacket4::intersect(const ChildBounds<4>& bounds, int child, int rayMask,
+		float& nearest) const
+	{
+		__m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds.min[0][child]), rays.origx4), rays.invdirx4);
+		__m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds.min[1][child]), rays.origy4), rays.invdiry4);
+		__m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds.min[2][child]), rays.origz4), rays.invdirz4);
+		__m128 t2x = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds.max[0][child]), rays.origx4), rays.invdirx4);
+		__m128 t2y = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds.max[1][child]), rays.origy4), rays.invdiry4);
+		__m128 t2z = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds.max[2][child]), rays.origz4), rays.invdirz4);
+		__m128 tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(t1x, t2x), _mm_min_ps(t1y, t2y)),
+			_mm_min_ps(t1z, t2z));
+		__m128 tmaxBox = _mm_min_ps(_mm_min_ps(_mm_max_ps(t1x, t2x), _mm_max_ps(t1y, t2y)),
+			_mm_max_ps(t1z, t2z));
+		__m128i lanes = _mm_setr_epi32(1, 2, 4, 8);
+		__m128 hit = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(rayMask), lanes), lanes));
+		hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(tmaxBox, tmin), _mm_cmpgt_ps(tmaxBox, _mm_setzero_ps())));
+		hit = _mm_and_ps(hit, _mm_cmplt_ps(tmin, tmax4));
+		__m128 dist = _mm_or_ps(_mm_and_ps(hit, tmin), _mm_andnot_ps(hit, _mm_set1_ps(FLT_MAX)));
+		dist = _mm_min_ps(dist, _mm_shuffle_ps(dist, dist, _MM_SHUFFLE(1, 0, 3, 2)));
+		dist = _mm_min_ps(dist, _mm_shuffle_ps(dist, dist, _MM_SHUFFLE(2, 3, 0, 1)));
+		nearest = _mm_cvtss_f32(dist);
+		return _mm_movemask_ps(hit);
+	}
+
+	int BVH::RayPacket4::cull(const ChildBounds<4>& bounds, int rayMask) const
+	{
+		if (!hasFrustum) return (1 << SIZE) - 1;
+		//the earliest entryDist and the latest exitDist of any ray in the packet
+		__m128 entryDist = _mm_set1_ps(-FLT_MAX);
+		__m128 exitDist = _mm_set1_ps(FLT_MAX);
+		for (int axis = 0; axis < 3; ++axis) {
+			const float *nearPlanes = nearSide[axis] ? bounds.max[axis] : bounds.min[axis];
+			const float *farPlanes = nearSide[axis] ? bounds.min[axis] : bounds.max[axis];
+			__m128 nearDist = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(nearPlanes), sign4[axis]), origHi4[axis]);
+			__m128 farDist = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(farPlanes), sign4[axis]), origLo4[axis]);
+			entryDist = _mm_max_ps(entryDist, _mm_min_ps(_mm_mul_ps(nearDist, invdirLo4[axis]),
+				_mm_mul_ps(nearDist, invdirHi4[axis])));
+			exitDist = _mm_min_ps(exitDist, _mm_max_ps(_mm_mul_ps(farDist, invdirLo4[axis]),
+				_mm_mul_ps(farDist, invdirHi4[axis])));
+		}
+		//the padding lanes of a partial packet keep FLT_MAX, they are left out
+		float maxLength = 0.0f;
+		for (int k = 0; k < SIZE; ++k) {
+			if ((rayMask & (1 << k)) && tmax[k] > maxLength) maxLength = tmax[k];
+		}
+		__m128 hit = _mm_and_ps(_mm_cmpgt_ps(exitDist, entryDist), _mm_cmpgt_ps(exitDist, _mm_setzero_ps()));
+		return _mm_movemask_ps(_mm_and_ps(hit, _mm_cmplt_ps(entryDist, _mm_set1_ps(maxLength))));
+	}
+
+	int BVH::RayPacket4::intersect(const LeafTriangle& triangle, float *dist) const
+	{
+		//the misses are tested negated, so NaNs go on like they do in the scalar version
+		__m128 one = _mm_set1_ps(1.0f);
+		__m128 zero = _mm_setzero_ps();
+		__m128 nx = _mm_set1_ps(triangle.normal.x);
+		__m128 ny = _mm_set1_ps(triangle.normal.y);
+		__m128 nz = _mm_set1_ps(triangle.normal.z);
+		__m128 denom = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dirx4, nx), _mm_mul_ps(diry4, ny)),
+			_mm_mul_ps(dirz4, nz));
+		__m128 absDenom = _mm_andnot_ps(_mm_set1_ps(-0.0f), denom);
+		__m128 valid = _mm_cmpnlt_ps(absDenom, _mm_set1_ps(FLT_EPSILON));
+		__m128 v0x = _mm_set1_ps(triangle.v0.x);
+		__m128 v0y = _mm_set1_ps(triangle.v0.y);
+		__m128 v0z = _mm_set1_ps(triangle.v0.z);
+		__m128 t = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_sub_ps(v0x, rays.origx4), nx),
+			_mm_mul_ps(_mm_sub_ps(v0y, rays.origy4), ny)), _mm_mul_ps(_mm_sub_ps(v0z, rays.origz4), nz)), denom);
+		valid = _mm_and_ps(valid, _mm_cmpnlt_ps(t, zero));
+		__m128 px = _mm_sub_ps(_mm_add_ps(rays.origx4, _mm_mul_ps(dirx4, t)), v0x);
+		__m128 py = _mm_sub_ps(_mm_add_ps(rays.origy4, _mm_mul_ps(diry4, t)), v0y);
+		__m128 pz = _mm_sub_ps(_mm_add_ps(rays.origz4, _mm_mul_ps(dirz4, t)), v0z);
+		__m128 d20 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(triangle.v0v1.x)),
+			_mm_mul_ps(py, _mm_set1_ps(triangle.v0v1.y))), _mm_mul_ps(pz, _mm_set1_ps(triangle.v0v1.z)));
+		__m128 d21 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(triangle.v0v2.x)),
+			_mm_mul_ps(py, _mm_set1_ps(triangle.v0v2.y))), _mm_mul_ps(pz, _mm_set1_ps(triangle.v0v2.z)));
+		__m128 d00 = _mm_set1_ps(triangle.d00);
+		__m128 d01 = _mm_set1_ps(triangle.d01);
+		__m128 d11 = _mm_set1_ps(triangle.d11);
+		__m128 invdenom = _mm_set1_ps(triangle.invdenom);
+		__m128 u = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(d11, d20), _mm_mul_ps(d01, d21)), invdenom);
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpnlt_ps(u, zero), _mm_cmpngt_ps(u, one)));
+		__m128 v = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(d00, d21), _mm_mul_ps(d01, d20)), invdenom);
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpnlt_ps(v, zero), _mm_cmpngt_ps(_mm_add_ps(v, u), one)));
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(t, zero), _mm_cmplt_ps(t, tmax4)));
+		_mm_storeu_ps(dist, t);
+		return _mm_movemask_ps(valid);
+	}
+
+	bool BVH::calcPacketFrustum(const float *orig, const float *invdir, int size, float *sign,
+		float *origLo, float *origHi, float *invdirLo, float *invdirHi)
+	{
+		//orig and invdir hold size lanes per axis
+		bool isValid = true;
+		for (int axis = 0; axis < 3; ++axis) {
+			const float *o = orig + axis * size;
+			const float *d = invdir + axis * size;
+			sign[axis] = d[0] < 0.0f ? -1.0f : 1.0f;
+			origLo[axis] = origHi[axis] = o[0] * sign[axis];
+			invdirLo[axis] = invdirHi[axis] = d[0] * sign[axis];
+			for (int k = 0; k < size; ++k) {
+				float mirroredOrig = o[k] * sign[axis];
+				float mirroredInvdir = d[k] * sign[axis];
+				//the bounds only hold while all the rays go the same way along the axis
+				if (!(mirroredInvdir > 0.0f && mirroredInvdir < FLT_MAX)) isValid = false;
+				origLo[axis] = std::min(origLo[axis], mirroredOrig);
+				origHi[axis] = std::max(origHi[axis], mirroredOrig);
+				invdirLo[axis] = std::min(invdirLo[axis], mirroredInvdir);
+				invdirHi[axis] = std::max(invdirHi[axis], mirroredInvdir);
+			}
+		}
+		return isValid;
+	}
+
+	void BVH::QuadNode::setBounds(const AABB *children, int count)
+	{
+		for (int i = 0; i < count; ++i) {
+			glm::vec3 minpt = children[i].getMinPt();
+			glm::vec3 maxpt = children[i].getMaxPt();
+			minx[i] = minpt.x;
+			miny[i] = minpt.y;
+			minz[i] = minpt.z;
+			maxx[i] = maxpt.x;
+			maxy[i] = maxpt.y;
+			maxz[i] = maxpt.z;
 		}
-		AABB bb = getSurroundAABB(primitives, size / 2);
-		bb.extend(getSurroundAABB(&primitives[size / 2], size - size / 2));
-		return bb;
 	}
 
-	size_t BVH::findSplit(Primitive** primitives, size_t size)
+	void BVH::OctNode::setBounds(const AABB *children, int count)
 	{
-		::uint64_t first = primitives[0]->m_mortonCode;
-		::uint64_t last = primitives[size - 1]->m_mortonCode;
+		for (int i = 0; i < count; ++i) {
+			glm::vec3 minpt = children[i].getMinPt();
+			glm::vec3 maxpt = children[i].getMaxPt();
+			minx[i] = minpt.x;
+			miny[i] = minpt.y;
+			minz[i] = minpt.z;
+			maxx[i] = maxpt.x;
+			maxy[i] = maxpt.y;
+			maxz[i] = maxpt.z;
+		}
+	}
+
+	void BVH::CompressedQuadNode::setBounds(const AABB *children, int count)
+	{
+		quantizeBounds(*this, children, count);
+	}
+
+	void BVH::CompressedOctNode::setBounds(const AABB *children, int count)
+	{
+		quantizeBounds(*this, children, count);
+	}
+
+	template<class CompressedNode>
+	void BVH::quantizeBounds(CompressedNode& node, const AABB *children, int count)
+	{
+		//"Efficient incoherent ray traversal on GPUs through compressed wide BVHs", Ylitie et al.
+		//a power of two scale keeps origin + q * scale down to a single rounding
+		AABB bounds = AABB::empty();
+		for (int i = 0; i < count; ++i) {
+			bounds.extend(children[i]);
+		}
+		//the root of an empty tree, any finite grid will do
+		if (count == 0) bounds = AABB(glm::vec3(0.0f), glm::vec3(0.0f));
+		unsigned char *qmin[3] = { node.qminx, node.qminy, node.qminz };
+		unsigned char *qmax[3] = { node.qmaxx, node.qmaxy, node.qmaxz };
+		for (int axis = 0; axis < 3; ++axis) {
+			float origin = bounds.getMinPt()[axis];
+			float top = bounds.getMaxPt()[axis];
+			int exponent;
+			frexp((top - origin) / 255.0f, &exponent);
+			exponent = std::min(std::max(exponent, -126), 127);
+			float scale = ldexp(1.0f, exponent);
+			while (origin + 255.0f * scale < top && exponent < 127) {
+				scale = ldexp(1.0f, ++exponent);
+			}
+			node.origin[axis] = origin;
+			node.exponent[axis] = static_cast<unsigned char>(exponent + 127);
+			for (int i = 0; i < count; ++i) {
+				float childMin = children[i].getMinPt()[axis];
+				float childMax = children[i].getMaxPt()[axis];
+				float lo = std::min(std::max(floor((childMin - origin) / scale), 0.0f), 255.0f);
+				float hi = std::min(std::max(ceil((childMax - origin) / scale), 0.0f), 255.0f);
+				//the division rounds too, step until the decoded bounds enclose the child
+				while (lo > 0.0f && origin + lo * scale > childMin) lo -= 1.0f;
+				while (hi < 255.0f && origin + hi * scale < childMax) hi += 1.0f;
+				qmin[axis][i] = static_cast<unsigned char>(lo);
+				qmax[axis][i] = static_cast<unsigned char>(hi);
+			}
+		}
+	}
+
+	size_t BVH::findSplit(const ::uint64_t* codes, size_t size)
+	{
+		::uint64_t first = codes[0];
+		::uint64_t last = codes[size - 1];
 		if (first == last) return size / 2;
 		::uint64_t diff = first ^ last;
 		int commonPrefix = lzcnt64(diff);
@@ -147,7 +1891,7 @@ namespace AGR
 			int newSplit = split + step;
 			if (newSplit < size)
 			{
-				::uint64_t splitCode = primitives[newSplit]->m_mortonCode;
+				::uint64_t splitCode = codes[newSplit];
 				int splitPrefix = lzcnt64(first ^ splitCode);
 				if (splitPrefix > commonPrefix)
 					split = newSplit;
@@ -183,96 +1927,451 @@ namespace AGR
 
 	void BVH::sortPrimitivesByMortonCodes()
 	{
-		AABB surround = getSurroundAABB(&m_primitives[0], m_primitives.size());
+		int size = static_cast<int>(m_primitives.size());
+		m_primCenters.resize(size);
+		m_mortonCodes.resize(size);
+		std::vector<int> indices(size);
+		concurrency::parallel_for(0, size, 1, [this](int i) {
+			m_primCenters[i] = m_primitives[i]->getBoundingBox().getCenter();
+		});
+		AABB surround = reduceBounds(size, [this](int i) {
+			return AABB(m_primCenters[i], m_primCenters[i]);
+		});
 		glm::vec3 surroundMin = surround.getMinPt();
 		glm::vec3 surroundMax = surround.getMaxPt();
-		for (int i = 0; i < m_primitives.size(); ++i) {
-			glm::vec3 bbCenter = m_primitives[i]->getBoundingBox().getCenter();
-			m_primitives[i]->m_mortonCode = CalcMortonCode(bbCenter, surroundMin, surroundMax);
+		concurrency::parallel_for(0, size, 1, [&](int i) {
+			m_mortonCodes[i] = CalcMortonCode(m_primCenters[i], surroundMin, surroundMax);
+			indices[i] = i;
+		});
+		radixSort(m_mortonCodes, indices, MORTON_BITS);
+		std::vector<Primitive *> sorted(size);
+		concurrency::parallel_for(0, size, 1, [this, &sorted, &indices](int i) {
+			sorted[i] = m_primitives[indices[i]];
+		});
+		m_primitives.swap(sorted);
+	}
+
+	void BVH::radixSort(std::vector<::uint64_t>& keys, std::vector<int>& values, int keyBits)
+	{
+		const int chunksAm = 64;
+		const int bucketsAm = 1 << RADIX_BITS;
+		const ::uint64_t mask = bucketsAm - 1;
+		int size = static_cast<int>(keys.size());
+		int chunkSize = size / chunksAm + 1;
+		std::vector<::uint64_t> keysTmp(size);
+		std::vector<int> valuesTmp(size);
+		std::vector<int> offsets(chunksAm * bucketsAm);
+		for (int shift = 0; shift < keyBits; shift += RADIX_BITS) {
+			concurrency::parallel_for(0, chunksAm, 1, [&](int iter) {
+				int *histogram = &offsets[iter * bucketsAm];
+				memset(histogram, 0, sizeof(int) * bucketsAm);
+				int from = chunkSize * iter;
+				int to = from + chunkSize < size ? from + chunkSize : size;
+				for (int i = from; i < to; ++i) {
+					++histogram[(keys[i] >> shift) & mask];
+				}
+			});
+			//digit major, chunk minor exclusive scan keeps the sort stable
+			int sum = 0;
+			bool isSorted = false;
+			for (int digit = 0; digit < bucketsAm && !isSorted; ++digit) {
+				for (int iter = 0; iter < chunksAm; ++iter) {
+					int count = offsets[iter * bucketsAm + digit];
+					offsets[iter * bucketsAm + digit] = sum;
+					sum += count;
+				}
+				//every key shares this digit, the pass would not move anything
+				isSorted = sum == size && offsets[digit] == 0;
+			}
+			if (isSorted) continue;
+			concurrency::parallel_for(0, chunksAm, 1, [&](int iter) {
+				int *offset = &offsets[iter * bucketsAm];
+				int from = chunkSize * iter;
+				int to = from + chunkSize < size ? from + chunkSize : size;
+				for (int i = from; i < to; ++i) {
+					int pos = offset[(keys[i] >> shift) & mask]++;
+					keysTmp[pos] = keys[i];
+					valuesTmp[pos] = values[i];
+				}
+			});
+			keys.swap(keysTmp);
+			values.swap(valuesTmp);
 		}
-		concurrency::parallel_buffered_sort(m_primitives.begin(), m_primitives.end(),
-			[](Primitive *a, Primitive *b)->bool {return a->m_mortonCode < b->m_mortonCode;});
 	}
 
-	bool BVH::Traverse(Ray& ray, RaySIMD& rsimd, Intersection& intersect, QuadNode *node, float minLength)
+	template<class WideNode>
+	void BVH::buildWideTree(WideNode *nodes, int parentNum, Node **children, int depth)
 	{
-		union
-		{
-			__m128 dist4;
-			float dist[4];
-		};
-		union
-		{
-			__m128 intersectFlags4;
-			unsigned int intersectFlags[4];
-		};
-		intersectFlags4 = node->intersect(rsimd, dist4);
+		m_wideTreeDepth = std::max(m_wideTreeDepth, depth);
+		WideNode *parent = &nodes[parentNum];
+		memset(parent, 0, sizeof(*parent));
+		AABB bounds[WideNode::WIDTH];
+		int count = 0;
+		while (count < WideNode::WIDTH && children[count]) {
+			bounds[count] = children[count]->bounds;
+			++count;
+		}
+		parent->setBounds(bounds, count);
+		//the order of the nodes is only settled by layoutWideNodes
+		for (int i = 0; i < count; ++i) {
+			if (isWideLeaf(children[i])) {
+				parent->child[i] = createLeaf(children[i]);
+				continue;
+			}
+			parent->child[i] = m_wideNodesCount++;
+			Node *newChildren[WideNode::WIDTH];
+			formWideNode(children[i], newChildren, WideNode::WIDTH);
+			buildWideTree(nodes, parent->child[i], newChildren, depth + 1);
+		}
+	}
+
+	template<class WideNode>
+	void BVH::layoutWideNodes(WideNodeVector<WideNode>& nodes)
+	{
+		//hot subtrees share a block: starting at its root, a block takes the
+		//children of the node a ray most likely reaches next, that chance being
+		//proportional to the surface area, all siblings at once and the larger
+		//ones first, the children that do not fit start the following blocks,
+		//depth first. a block is one node short of a page, so the block roots,
+		//which every ray entering a block reads, spread over the cache sets
+		int count = static_cast<int>(nodes.size());
+		int blockSize = std::max(2, static_cast<int>(LAYOUT_BLOCK_SIZE / sizeof(WideNode)) - 1);
+		typedef std::pair<float, int> WeightedNode;
+		std::vector<WeightedNode> blockRoots;
+		std::vector<WeightedNode> leftOver;
+		std::vector<int> order;
+		order.reserve(count);
+		blockRoots.push_back(WeightedNode(FLT_MAX, 0));
+		ChildBounds<WideNode::WIDTH> bounds;
+		while (!blockRoots.empty()) {
+			std::priority_queue<WeightedNode> parents;
+			parents.push(blockRoots.back());
+			order.push_back(blockRoots.back().second);
+			blockRoots.pop_back();
+			int placed = 1;
+			while (!parents.empty()) {
+				const WideNode& node = nodes[parents.top().second];
+				parents.pop();
+				node.decodeBounds(bounds);
+				WeightedNode children[WideNode::WIDTH];
+				int childrenAm = 0;
+				//children are packed to the front, empty slots have no child
+				for (int i = 0; i < WideNode::WIDTH && node.child[i] != 0; ++i) {
+					if (node.isLeaf[i] & WideNode::LEAF_FLAG) continue;
+					float x = bounds.max[0][i] - bounds.min[0][i];
+					float y = bounds.max[1][i] - bounds.min[1][i];
+					float z = bounds.max[2][i] - bounds.min[2][i];
+					children[childrenAm++] = WeightedNode(x * y + y * z + z * x, node.child[i]);
+				}
+				std::sort(children, children + childrenAm, std::greater<WeightedNode>());
+				if (placed + childrenAm > blockSize) {
+					leftOver.insert(leftOver.end(), children, children + childrenAm);
+					continue;
+				}
+				placed += childrenAm;
+				for (int i = 0; i < childrenAm; ++i) {
+					order.push_back(children[i].second);
+					parents.push(children[i]);
+				}
+			}
+			//the most likely of them is taken next
+			std::sort(leftOver.begin(), leftOver.end());
+			blockRoots.insert(blockRoots.end(), leftOver.begin(), leftOver.end());
+			leftOver.clear();
+		}
+		std::vector<int> newNums(count);
+		for (int i = 0; i < count; ++i) newNums[order[i]] = i;
+		WideNodeVector<WideNode> laidOut(count);
+		concurrency::parallel_for(0, count, 1, [&](int i) {
+			WideNode& node = laidOut[i];
+			node = nodes[order[i]];
+			for (int k = 0; k < WideNode::WIDTH && node.child[k] != 0; ++k) {
+				if (!(node.isLeaf[k] & WideNode::LEAF_FLAG)) node.child[k] = newNums[node.child[k]];
+			}
+		});
+		nodes.swap(laidOut);
+	}
+
+	int BVH::countWideNodes(Node *parent, int width)
+	{
+		Node *children[MAX_NODE_WIDTH];
+		formWideNode(parent, children, width);
+		int count = 1;
+		for (int i = 0; i < width && children[i]; ++i) {
+			if (!isWideLeaf(children[i])) {
+				count += countWideNodes(children[i], width);
+			}
+		}
+		return count;
+	}
+
+	bool BVH::isWideLeaf(const Node *node) const
+	{
+		return (node->isLeaf & Node::LEAF_FLAG) || m_collapseCosts[node - &m_nodes[0]].isLeaf;
+	}
+
+	int BVH::createLeaf(const Node *node)
+	{
+		int first = static_cast<int>(m_leafPrimitives.size());
+		collectLeafPrimitives(static_cast<int>(node - &m_nodes[0]));
+		int size = static_cast<int>(m_leafPrimitives.size()) - first;
+		//the first reference has to fit next to the flags and the size
+		assert(static_cast<unsigned int>(first + size - 1) <= LEAF_FIRST_MASK);
+		unsigned int leaf = Node::LEAF_FLAG | (size - 1) << LEAF_SIZE_SHIFT | first;
+		//grouped by type, so the type switch of mixed leaves is predictable
+		std::stable_sort(m_leafPrimitives.begin() + first, m_leafPrimitives.begin() + first + size,
+			[](const Primitive *a, const Primitive *b) { return getLeafType(a) < getLeafType(b); });
+		LeafType firstType = getLeafType(m_leafPrimitives[first]);
+		LeafType lastType = getLeafType(m_leafPrimitives[first + size - 1]);
+		if (firstType == lastType && firstType == TRIANGLE_LEAF) leaf |= TRIANGLE_LEAF_FLAG;
+		if (firstType == lastType && firstType == SPHERE_LEAF) leaf |= SPHERE_LEAF_FLAG;
+		return static_cast<int>(leaf);
+	}
+
+	void BVH::collectLeafPrimitives(int nodeNum)
+	{
+		const Node& node = m_nodes[nodeNum];
+		if (node.isLeaf & Node::LEAF_FLAG) {
+			m_leafPrimitives.push_back(m_primitives[node.primitiveNum]);
+			return;
+		}
+		collectLeafPrimitives(node.left);
+		collectLeafPrimitives(node.right);
+	}
+
+	BVH::LeafType BVH::getLeafType(const Primitive *primitive)
+	{
+		if (primitive->asTriangle()) return TRIANGLE_LEAF;
+		if (primitive->asSphere()) return SPHERE_LEAF;
+		if (primitive->asMeshInstance()) return INSTANCE_LEAF;
+		return OTHER_LEAF;
+	}
+
+	void BVH::setLeafCopies(int reference)
+	{
+		const Primitive *primitive = m_leafPrimitives[reference];
+		m_leafTypes[reference] = getLeafType(primitive);
+		LeafSphere& leafSphere = m_leafSpheres[reference];
+		const Sphere *sphere = primitive->asSphere();
+		if (sphere) {
+			leafSphere.center = sphere->getPosition();
+			leafSphere.radius2 = sphere->getRadius() * sphere->getRadius();
+		} else {
+			leafSphere = LeafSphere();
+		}
+		LeafTriangle& leafTriangle = m_leafTriangles[reference];
+		const Triangle *triangle = primitive->asTriangle();
+		if (!triangle) {
+			leafTriangle = LeafTriangle();
+			return;
+		}
+		leafTriangle.v0 = triangle->m_vert[0].position;
+		leafTriangle.v0v1 = triangle->m_v0v1;
+		leafTriangle.v0v2 = triangle->m_v0v2;
+		leafTriangle.normal = triangle->m_normal;
+		leafTriangle.d00 = triangle->m_d00;
+		leafTriangle.d01 = triangle->m_d01;
+		leafTriangle.d11 = triangle->m_d11;
+		leafTriangle.invdenom = triangle->m_invdenom;
+	}
+
+	template<class Query, class Faces>
+	bool BVH::intersectLeaf(const Ray& ray, unsigned int leaf, float tmax, Intersection& intersect) const
+	{
+		int first = leaf & LEAF_FIRST_MASK;
+		int last = first + ((leaf >> LEAF_SIZE_SHIFT) & (MAX_LEAF_SIZE - 1)) + 1;
 		bool wasHit = false;
-		for (int i = 0; i < 4; ++i) {
-			if (intersectFlags[i] && (intersect.ray_length < 0 || dist[i] < intersect.ray_length)) {
-				if (node->isLeaf[i] & QuadNode::LEAF_FLAG) {
-					Primitive* obj = m_primitives[node->child[i] & (~QuadNode::LEAF_FLAG)];
-					float rayLen = obj->intersect(ray);
-					if (rayLen > 0) {
-						if (intersect.ray_length < 0 || rayLen < intersect.ray_length) {
-							intersect.ray_length = rayLen;
-							intersect.p_object = obj;
-							wasHit = true;
-						}
-					}
-				} else {
-					wasHit |= Traverse(ray, rsimd, intersect, 
-						&m_quadNodes[node->child[i] & (~QuadNode::LEAF_FLAG)], minLength);
+		if (leaf & TRIANGLE_LEAF_FLAG) {
+			//adjacent triangle copies, the primitives are only touched on a hit
+			for (int i = first; i < last; ++i) {
+				const LeafTriangle& triangle = m_leafTriangles[i];
+				if (Faces::CULLS_BACKFACES && glm::dot(ray.direction, triangle.normal) > 0) continue;
+				float rayLen = triangle.intersect(ray);
+				if (rayLen > 0 && rayLen < tmax) {
+					tmax = rayLen;
+					intersect.ray_length = rayLen;
+					intersect.p_object = m_leafPrimitives[i];
+					intersect.primitive_index = i;
+					if (Query::IS_ANY_HIT) return true;
+					wasHit = true;
 				}
-				if (intersect.ray_length > 0.0f && intersect.ray_length < minLength) return true;
+			}
+			return wasHit;
+		}
+		if (leaf & SPHERE_LEAF_FLAG) {
+			for (int i = first; i < last; ++i) {
+				float rayLen = m_leafSpheres[i].intersect(ray);
+				if (rayLen > 0 && rayLen < tmax) {
+					tmax = rayLen;
+					intersect.ray_length = rayLen;
+					intersect.p_object = m_leafPrimitives[i];
+					intersect.primitive_index = i;
+					if (Query::IS_ANY_HIT) return true;
+					wasHit = true;
+				}
+			}
+			return wasHit;
+		}
+		for (int i = first; i < last; ++i) {
+			float rayLen;
+			switch (m_leafTypes[i]) {
+			case TRIANGLE_LEAF:
+				//only triangles have a front face
+				if (Faces::CULLS_BACKFACES && glm::dot(ray.direction, m_leafTriangles[i].normal) > 0) continue;
+				rayLen = m_leafTriangles[i].intersect(ray);
+				break;
+			case SPHERE_LEAF:
+				rayLen = m_leafSpheres[i].intersect(ray);
+				break;
+			case INSTANCE_LEAF:
+				//the instance runs the same query on its own tree and fills in the hit
+				if (static_cast<const MeshInstance *>(m_leafPrimitives[i])->traverseMesh<Query, Faces>(
+					ray, tmax, intersect)) {
+					tmax = intersect.ray_length;
+					if (Query::IS_ANY_HIT) return true;
+					wasHit = true;
+				}
+				continue;
+			default:
+				rayLen = m_leafPrimitives[i]->intersect(ray);
+				break;
+			}
+			if (rayLen > 0 && rayLen < tmax) {
+				tmax = rayLen;
+				intersect.ray_length = rayLen;
+				intersect.p_object = m_leafPrimitives[i];
+				intersect.primitive_index = i;
+				if (Query::IS_ANY_HIT) return true;
+				wasHit = true;
 			}
 		}
 		return wasHit;
 	}
 
-	void BVH::buildQuadTree(QuadNode * parent, Node ** children)
+	AABB BVH::refitLeaf(unsigned int leaf)
 	{
-		memset(parent, 0, sizeof(*parent));
-		for (int i = 0; i < 4; ++i) {
-			if (children[i]) {
-				glm::vec3 minpt = children[i]->bounds.getMinPt();
-				glm::vec3 maxpt = children[i]->bounds.getMaxPt();
-				parent->minx[i] = minpt.x;
-				parent->miny[i] = minpt.y;
-				parent->minz[i] = minpt.z;
-				parent->maxx[i] = maxpt.x;
-				parent->maxy[i] = maxpt.y;
-				parent->maxz[i] = maxpt.z;
-				if (children[i]->isLeaf & Node::LEAF_FLAG) {
-					parent->child[i] = children[i]->primitiveNum;
-				} else {
-					parent->child[i] = m_quadNodesCount;
-					Node *newChildren[4];
-					formQuadNode(children[i], newChildren);
-					buildQuadTree(&m_quadNodes[m_quadNodesCount++], newChildren);
-				}
-				parent->isLeaf[i] |= children[i]->isLeaf & Node::LEAF_FLAG;
-			} 
+		int first = leaf & LEAF_FIRST_MASK;
+		int last = first + ((leaf >> LEAF_SIZE_SHIFT) & (MAX_LEAF_SIZE - 1)) + 1;
+		AABB bounds = AABB::empty();
+		for (int i = first; i < last; ++i) {
+			bounds.extend(m_leafPrimitives[i]->getBoundingBox());
+			setLeafCopies(i);
+		}
+		return bounds;
+	}
+
+	float BVH::LeafTriangle::intersect(const Ray& r) const
+	{
+		//same steps as Triangle::intersect, so both give the same distances
+		float denom = glm::dot(r.direction, normal);
+		if (glm::abs(denom) < FLT_EPSILON) return -1.0f;
+		float dist = glm::dot(v0 - r.origin, normal) / denom;
+		if (dist < 0) return -1.0f;
+		glm::vec3 v0pt = r.origin + r.direction * dist - v0;
+		float d20 = glm::dot(v0pt, v0v1);
+		float d21 = glm::dot(v0pt, v0v2);
+		float u = (d11 * d20 - d01 * d21) * invdenom;
+		if (u < 0 || u > 1) return -1.0f;
+		float v = (d00 * d21 - d01 * d20) * invdenom;
+		if (v < 0 || v + u > 1) return -1.0f;
+		return dist;
+	}
+
+	float BVH::LeafSphere::intersect(const Ray& r) const
+	{
+		//same steps as Sphere::intersect
+		glm::vec3 sphere2ray = r.origin - center;
+		float a = glm::dot(r.direction, r.direction);
+		float b = glm::dot(r.direction * 2.0f, sphere2ray);
+		float c = glm::dot(sphere2ray, sphere2ray) - radius2;
+		float dsqr = b * b - 4 * a * c;
+		if (dsqr < 0) return -1.0f;
+		if (dsqr < FLT_EPSILON) {
+			float t = -b / (2 * a);
+			if (t > 0) return t;
 		}
+		float d = sqrt(dsqr);
+		float t = (-b - d) / (2 * a);
+		if (t < 0) t = (-b + d) / (2 * a);
+		return t;
+	}
+
+	void BVH::formWideNode(Node* parent, Node **children, int width)
+	{
+		memset(children, 0, sizeof(children[0]) * width);
+		int leftSlots = m_collapseCosts[parent - &m_nodes[0]].split[0];
+		int count = 0;
+		collectSlots(parent->left, leftSlots, children, count);
+		collectSlots(parent->right, width - leftSlots, children, count);
 	}
 
-	void BVH::formQuadNode(Node* parent, Node **children)
+	void BVH::calcCollapseCosts(int nodeNum, int depth, int width)
 	{
-		memset(children, 0, sizeof(children[0]) * 4);
-		int curAm = 2;
-		children[0] = &m_nodes[parent->left];
-		children[1] = &m_nodes[parent->right];
-		bool modified = false;
-		do {
-			modified = false;
-			for (int i = 0; i < curAm && curAm < 4; ++i) {
-				if (!(children[i]->isLeaf & Node::LEAF_FLAG)) {
-					modified = true;
-					children[curAm++] = &m_nodes[children[i]->right];
-					children[i] = &m_nodes[children[i]->left];
+		//cheapest way to pull the binary subtrees up into wide nodes,
+		//"Efficient incoherent ray traversal on GPUs through compressed wide BVHs", Ylitie et al.
+		Node& node = m_nodes[nodeNum];
+		CollapseCost& collapse = m_collapseCosts[nodeNum];
+		memset(collapse.split, 0, sizeof(collapse.split));
+		collapse.isLeaf = false;
+		if (node.isLeaf & Node::LEAF_FLAG) {
+			collapse.primitivesAm = 1;
+			for (int slots = 1; slots <= width; ++slots) {
+				collapse.cost[slots] = SAH_PRIMITIVE_COST * node.bounds.calcArea();
+			}
+			return;
+		}
+		if (depth < PARALLEL_DEPTH) {
+			concurrency::parallel_invoke(
+				[&] { calcCollapseCosts(node.left, depth + 1, width); },
+				[&] { calcCollapseCosts(node.right, depth + 1, width); });
+		} else {
+			calcCollapseCosts(node.left, depth + 1, width);
+			calcCollapseCosts(node.right, depth + 1, width);
+		}
+		const CollapseCost& left = m_collapseCosts[node.left];
+		const CollapseCost& right = m_collapseCosts[node.right];
+		float best = FLT_MAX;
+		for (int leftSlots = 1; leftSlots < width; ++leftSlots) {
+			float cost = left.cost[leftSlots] + right.cost[width - leftSlots];
+			if (cost < best) {
+				best = cost;
+				collapse.split[0] = leftSlots;
+			}
+		}
+		collapse.cost[1] = SAH_NODE_COST * node.bounds.calcArea() + best;
+		//or all of its primitives tested right away as one leaf
+		collapse.primitivesAm = left.primitivesAm + right.primitivesAm;
+		if (collapse.primitivesAm <= m_maxLeafSize) {
+			float leafCost = SAH_PRIMITIVE_COST * node.bounds.calcArea() * collapse.primitivesAm;
+			if (leafCost < collapse.cost[1]) {
+				collapse.cost[1] = leafCost;
+				collapse.isLeaf = true;
+			}
+		}
+		//a smaller amount of slots may be enough, which leaves partial wide nodes
+		for (int slots = 2; slots <= width; ++slots) {
+			collapse.cost[slots] = collapse.cost[slots - 1];
+			for (int leftSlots = 1; leftSlots < slots; ++leftSlots) {
+				float cost = left.cost[leftSlots] + right.cost[slots - leftSlots];
+				if (cost < collapse.cost[slots]) {
+					collapse.cost[slots] = cost;
+					collapse.split[slots] = leftSlots;
 				}
 			}
-		} while (modified);
+		}
+	}
+
+	void BVH::collectSlots(int nodeNum, int slots, Node **children, int& count)
+	{
+		const CollapseCost& collapse = m_collapseCosts[nodeNum];
+		while (slots > 1 && collapse.split[slots] == 0) --slots;
+		if (slots == 1) {
+			children[count++] = &m_nodes[nodeNum];
+			return;
+		}
+		int leftSlots = collapse.split[slots];
+		collectSlots(m_nodes[nodeNum].left, leftSlots, children, count);
+		collectSlots(m_nodes[nodeNum].right, slots - leftSlots, children, count);
 	}
 
 	int BVH::BuildTreeAgglomerative(NodePair *nodesArr, int size)
@@ -291,9 +2390,18 @@ namespace AGR
 			return clusterSize;
 		}
 		int firstPrimitiveIdx = m_nodes[nodesArr->nodeNum].primitiveNum;
-		size_t split = findSplit(&m_primitives[firstPrimitiveIdx], size);
-		int newSize = BuildTreeAgglomerative(nodesArr, split);
-		newSize += BuildTreeAgglomerative(&nodesArr[split], size - split);
+		size_t split = findSplit(&m_mortonCodes[firstPrimitiveIdx], size);
+		int newSize;
+		if (size > AAC_PARALLEL_THRESHOLD) {
+			int leftSize, rightSize;
+			concurrency::parallel_invoke(
+				[&] { leftSize = BuildTreeAgglomerative(nodesArr, split); },
+				[&] { rightSize = BuildTreeAgglomerative(&nodesArr[split], size - split); });
+			newSize = leftSize + rightSize;
+		} else {
+			newSize = BuildTreeAgglomerative(nodesArr, split);
+			newSize += BuildTreeAgglomerative(&nodesArr[split], size - split);
+		}
 		for (int i = 0; i < size; ++i) {
 			if (nodesArr[i].nodeNum > 0) {
 				nodesArr[curPos] = nodesArr[i];
@@ -308,45 +2416,81 @@ namespace AGR
 
 	void BVH::combineClusters(NodePair *nodesArr, int size, int amount)
 	{
-		int curSize = size;
+		//the best match of every node waits in a heap, a match whose nodes were
+		//merged meanwhile is only searched again once it comes up. merging only
+		//grows bounds, so the new match is never closer than the stale one.
+		//both buffers are kept per thread, as most clusters are small and many
+		thread_local std::vector<ClusterBounds> bounds;
+		thread_local std::vector<ClusterMatch> matches;
+		bounds.resize(size);
+		matches.clear();
 		for (int i = 0; i < size; ++i) {
-			findBestMatch(&nodesArr[i], nodesArr, size);
+			if (nodesArr[i].nodeNum == -1) continue;
+			const AABB& nodeBounds = m_nodes[nodesArr[i].nodeNum].bounds;
+			bounds[i] = { nodeBounds.getMinPt(), nodeBounds.getMaxPt() };
 		}
-		while (curSize > amount) {
-			NodePair *bestPair = nodesArr;
-			for (int i = 1; i < size; ++i) {
-				if (nodesArr[i].dist < bestPair->dist) {
-					bestPair = &nodesArr[i];
-				}
-			}
-			m_nodes[m_nodesCount].left = bestPair->nodeNum;
-			m_nodes[m_nodesCount].right = bestPair->closestNode->nodeNum;
-			m_nodes[m_nodesCount].bounds = m_nodes[bestPair->nodeNum].bounds;
-			m_nodes[m_nodesCount].bounds.extend(m_nodes[bestPair->closestNode->nodeNum].bounds);
-			NodePair* deleted1 = bestPair->closestNode;
-			NodePair* deleted2 = bestPair;
-			*bestPair->closestNode = { -1, nullptr, FLT_MAX };
-			*bestPair = { m_nodesCount, nullptr, FLT_MAX };
-			findBestMatch(bestPair, nodesArr, size);
-			for (int i = 0; i < size; ++i) {
-				if (nodesArr[i].closestNode == deleted1 ||
-					nodesArr[i].closestNode == deleted2) {
-					findBestMatch(&nodesArr[i], nodesArr, size);
+		auto pushMatch = [&](int i) {
+			if (nodesArr[i].closestNode == nullptr) return;
+			int closest = static_cast<int>(nodesArr[i].closestNode - nodesArr);
+			matches.push_back({ nodesArr[i].dist, i, nodesArr[i].nodeNum, closest, nodesArr[closest].nodeNum });
+			std::push_heap(matches.begin(), matches.end(), std::greater<ClusterMatch>());
+		};
+		//every distance of the first matches is computed once for both nodes
+		for (int i = 0; i < size; ++i) {
+			nodesArr[i].dist = FLT_MAX;
+			nodesArr[i].closestNode = nullptr;
+		}
+		for (int i = 0; i < size; ++i) {
+			if (nodesArr[i].nodeNum == -1) continue;
+			for (int j = i + 1; j < size; ++j) {
+				if (nodesArr[j].nodeNum == -1) continue;
+				float dist = bounds[i].calcUnitedArea(bounds[j]);
+				if (dist < nodesArr[i].dist) {
+					nodesArr[i].dist = dist;
+					nodesArr[i].closestNode = &nodesArr[j];
+				}
+				if (dist < nodesArr[j].dist) {
+					nodesArr[j].dist = dist;
+					nodesArr[j].closestNode = &nodesArr[i];
 				}
 			}
-			++m_nodesCount;
+			pushMatch(i);
+		}
+		int curSize = size;
+		while (curSize > amount) {
+			std::pop_heap(matches.begin(), matches.end(), std::greater<ClusterMatch>());
+			ClusterMatch match = matches.back();
+			matches.pop_back();
+			if (nodesArr[match.node].nodeNum != match.nodeNum) continue;
+			if (nodesArr[match.closest].nodeNum != match.closestNum) {
+				findBestMatch(&nodesArr[match.node], nodesArr, size, bounds.data());
+				pushMatch(match.node);
+				continue;
+			}
+			NodePair *bestPair = &nodesArr[match.node];
+			NodePair *closestPair = &nodesArr[match.closest];
+			int newNode = m_nodesCount++;
+			m_nodes[newNode].left = bestPair->nodeNum;
+			m_nodes[newNode].right = closestPair->nodeNum;
+			m_nodes[newNode].bounds = AABB(glm::min(bounds[match.node].minPt, bounds[match.closest].minPt),
+				glm::max(bounds[match.node].maxPt, bounds[match.closest].maxPt));
+			*closestPair = { -1, nullptr, FLT_MAX };
+			*bestPair = { newNode, nullptr, FLT_MAX };
+			bounds[match.node] = { m_nodes[newNode].bounds.getMinPt(), m_nodes[newNode].bounds.getMaxPt() };
+			findBestMatch(bestPair, nodesArr, size, bounds.data());
+			pushMatch(match.node);
 			--curSize;
 		}
 	}
 
-	void BVH::findBestMatch(NodePair* node, NodePair *nodesArr, int count)
+	void BVH::findBestMatch(NodePair* node, NodePair *nodesArr, int count, const ClusterBounds *bounds)
 	{
 		node->dist = FLT_MAX;
+		node->closestNode = nullptr;
+		const ClusterBounds& nodeBounds = bounds[node - nodesArr];
 		for (int i = 0; i < count; ++i) {
 			if (node != &nodesArr[i] && nodesArr[i].nodeNum != -1) {
-				AABB united = m_nodes[node->nodeNum].bounds;
-				united.extend(m_nodes[nodesArr[i].nodeNum].bounds);
-				float curDist = united.calcArea();
+				float curDist = nodeBounds.calcUnitedArea(bounds[i]);
 				if (curDist < node->dist) {
 					node->dist = curDist;
 					node->closestNode = &nodesArr[i];
@@ -361,4 +2505,19 @@ namespace AGR
 		int am = round(scaler * pow(amountOfNodes, 0.5f - CLUSTERFUNC_EPSILON));
 		return am <= amountOfNodes ? am : amountOfNodes;
 	}
+
+	//the kernels the renderers and primitives may ask for
+	template bool BVH::Traverse<BVH::ClosestHit, BVH::AllFaces>(const Ray&, Intersection&, float);
+	template bool BVH::Traverse<BVH::ClosestHit, BVH::NoBackfaces>(const Ray&, Intersection&, float);
+	template bool BVH::Traverse<BVH::AnyHit, BVH::AllFaces>(const Ray&, Intersection&, float);
+	template bool BVH::Traverse<BVH::AnyHit, BVH::NoBackfaces>(const Ray&, Intersection&, float);
+	//for the 8 wide kernels in BVHAvx2.cpp
+	template bool BVH::intersectLeaf<BVH::ClosestHit, BVH::AllFaces>(const Ray&, unsigned int,
+		float, Intersection&) const;
+	template bool BVH::intersectLeaf<BVH::ClosestHit, BVH::NoBackfaces>(const Ray&, unsigned int,
+		float, Intersection&) const;
+	template bool BVH::intersectLeaf<BVH::AnyHit, BVH::AllFaces>(const Ray&, unsigned int,
+		float, Intersection&) const;
+	template bool BVH::intersectLeaf<BVH::AnyHit, BVH::NoBackfaces>(const Ray&, unsigned int,
+		float, Intersection&) const;
 }
@@ -1,16 +1,107 @@
 #pragma once
 #include <vector>
+#include <cfloat>
+#include <atomic>
+#include <string>
 #include "renederables/Primitive.h"
 #include "AABB.h"
+#include "MappedFile.h"
+#include "AlignedAllocator.h"
 
 namespace AGR
 {
 	class BVH
 	{
 	public:
+		enum BuildMethod
+		{
+			AGGLOMERATIVE, //Morton sort + approximate agglomerative clustering
+			BINNED_SAH,    //top-down surface area heuristic over centroid bins
+			PLOC,          //parallel locally-ordered clustering along the Morton curve
+			LBVH,          //Karras radix tree, fastest to build, lowest quality
+			SBVH           //binned SAH with spatial splits of overlapping primitives
+		};
+
+		//queries of Traverse, every combination with a faces policy is compiled
+		//into its own kernel, so none of them carries the tests of the others
+		struct ClosestHit
+		{
+			static const bool IS_ANY_HIT = false;
+		};
+		//stops at the first hit found, the children are visited in any order
+		struct AnyHit
+		{
+			static const bool IS_ANY_HIT = true;
+		};
+		struct AllFaces
+		{
+			static const bool CULLS_BACKFACES = false;
+		};
+		//triangles facing away from the ray are not hit
+		struct NoBackfaces
+		{
+			static const bool CULLS_BACKFACES = true;
+		};
+
 		void construct(std::vector<Primitive *>& primitives);
-		bool Traverse(Ray& ray, Intersection& intersect, float minLength);
+		//reuses the tree stored in the cache file when it was built over the same
+		//primitive bounds and settings, builds and stores it otherwise
+		void construct(std::vector<Primitive *>& primitives, const std::string& cachePath);
+		//updates the bounds after the primitives moved, rebuilds the tree
+		//when its SAH cost degraded past the refit threshold
+		void refit();
+		void setRefitThreshold(float threshold) { m_refitThreshold = threshold; }
+		float getRefitThreshold() const { return m_refitThreshold; }
+		void setBuildMethod(BuildMethod method) { m_buildMethod = method; }
+		BuildMethod getBuildMethod() const { return m_buildMethod; }
+		//treelet restructuring passes run after construction, 0 disables them
+		void setTreeletPasses(int passes) { m_treeletPasses = passes; }
+		int getTreeletPasses() const { return m_treeletPasses; }
+		//extra primitive references the SBVH builder may create, as a fraction
+		//of the primitives amount
+		void setSpatialSplitBudget(float budget) { m_spatialSplitBudget = budget; }
+		float getSpatialSplitBudget() const { return m_spatialSplitBudget; }
+		//children per traversal node, 4 (SSE) or 8 (AVX2 and FMA),
+		//takes effect on the next construct, cpus without AVX2 get 4 anyway
+		void setNodeWidth(int width) { m_nodeWidth = width == 8 ? 8 : 4; }
+		int getNodeWidth() const { return m_nodeWidth; }
+		//child bounds stored as 8 bit offsets on a per node grid, the boxes
+		//get slightly larger but the nodes take about half the memory
+		void setCompressedNodes(bool compressed) { m_compressedNodes = compressed; }
+		bool getCompressedNodes() const { return m_compressedNodes; }
+		//upper limit of the primitives in one traversal leaf, 1 to 8, the leaves
+		//themselves are chosen by SAH when the binary tree is collapsed
+		void setMaxLeafSize(int size) { m_maxLeafSize = size < 1 ? 1 : size > MAX_LEAF_SIZE ? MAX_LEAF_SIZE : size; }
+		int getMaxLeafSize() const { return m_maxLeafSize; }
+		//incremental changes of a built tree, the wide nodes used for traversal
+		//are rebuilt once for all of them by commitUpdates
+		void insert(Primitive *primitive);
+		bool remove(Primitive *primitive);
+		//returns false when there was nothing to commit
+		bool commitUpdates();
+		bool isBuilt() const { return m_wideNodesCount > 0; }
+		const AABB& getBounds() const { return m_bounds; }
+		//the primitive a hit of this tree names by its primitive_index
+		Primitive *getLeafPrimitive(int index) const { return m_leafPrimitives[index]; }
+		//hits closer than length only, returns whether there was one, instantiated
+		//for both queries with both faces policies
+		template<class Query = ClosestHit, class Faces = AllFaces>
+		bool Traverse(const Ray& ray, Intersection& intersect, float length = FLT_MAX);
+		//closest hits of all the rays, neighbouring rays in the vector are traced
+		//together as packets, so coherent rays such as camera rays should be adjacent
 		void PacketTraverse(std::vector<Ray>& rays, std::vector<Intersection>& intersect);
+		//for incoherent rays, they are ordered by origin cell and then by direction
+		//along Morton curves before the packets are formed, the hits are scattered
+		//back so intersect still matches rays
+		void SortedPacketTraverse(std::vector<Ray>& rays, std::vector<Intersection>& intersect);
+		//closest hits of all the rays, each thread keeps several of them in flight
+		//and moves to the next one after every node, while the node that ray
+		//needs next is prefetched, so scenes too large for the caches stall less,
+		//for rays that mostly find their nodes cached Traverse is cheaper
+		void InterleavedTraverse(std::vector<Ray>& rays, std::vector<Intersection>& intersect);
+		//whether anything is hit closer than length, stops at the first such hit
+		//without looking for the closest one
+		bool CheckOcclusion(const Ray& ray, float length);
 		void PacketCheckOcclusions(std::vector<Ray>& rays, 
 			std::vector<float>& lengths, std::vector<bool>& occlusionFlags);
 	private:
@@ -22,6 +113,14 @@ namespace AGR
 			const static unsigned int LEAF_FLAG = 0x80000000;
 		};
 
+		//child boxes of any node layout as plain floats, read by the packet traversal
+		template<int Width>
+		struct ChildBounds
+		{
+			float min[3][Width];
+			float max[3][Width];
+		};
+
 		struct RaySIMD
 		{
 			__m128 origx4;
@@ -32,6 +131,78 @@ namespace AGR
 			__m128 invdirz4;
 		};
 
+		struct RaySIMD8
+		{
+			__m256 origInvDirx8;
+			__m256 origInvDiry8;
+			__m256 origInvDirz8;
+			__m256 invdirx8;
+			__m256 invdiry8;
+			__m256 invdirz8;
+		};
+
+		struct LeafTriangle;
+
+		//a packet has a ray per lane and as many rays as the nodes have children,
+		//so the same registers serve the per ray box tests and the per child
+		//frustum tests
+		struct RayPacket4
+		{
+			static const int SIZE = 4;
+			RaySIMD rays;
+			__m128 dirx4;
+			__m128 diry4;
+			__m128 dirz4;
+			union { __m128 tmax4; float tmax[4]; };
+			//interval arithmetic bounds of all the rays, axes along which the rays
+			//go backwards are mirrored, so the near planes are always the min ones
+			bool hasFrustum;
+			int nearSide[3];
+			__m128 sign4[3];
+			__m128 origLo4[3];
+			__m128 origHi4[3];
+			__m128 invdirLo4[3];
+			__m128 invdirHi4[3];
+			//lanes past count repeat the first ray
+			void init(const Ray *const *r, int count);
+			//bit mask of the rays whose interval reaches past dist
+			int activeRays(float dist) const;
+			//bit mask of the rays in rayMask entering the child before their tmax,
+			//nearest gets the closest of their entry distances
+			int intersect(const ChildBounds<4>& bounds, int child, int rayMask, float& nearest) const;
+			//bit mask of the children the frustum may enter before the farthest
+			//tmax of the rays in rayMask, all of them without a frustum
+			int cull(const ChildBounds<4>& bounds, int rayMask) const;
+			//bit mask of the rays hitting the triangle before their tmax, the same
+			//steps as LeafTriangle::intersect, so the distances are the same too
+			int intersect(const LeafTriangle& triangle, float *dist) const;
+		};
+
+		struct RayPacket8
+		{
+			static const int SIZE = 8;
+			RaySIMD8 rays;
+			__m256 origx8;
+			__m256 origy8;
+			__m256 origz8;
+			__m256 dirx8;
+			__m256 diry8;
+			__m256 dirz8;
+			union { __m256 tmax8; float tmax[8]; };
+			bool hasFrustum;
+			int nearSide[3];
+			__m256 sign8[3];
+			__m256 origLo8[3];
+			__m256 origHi8[3];
+			__m256 invdirLo8[3];
+			__m256 invdirHi8[3];
+			void init(const Ray *const *r, int count);
+			int activeRays(float dist) const;
+			int intersect(const ChildBounds<8>& bounds, int child, int rayMask, float& nearest) const;
+			int cull(const ChildBounds<8>& bounds, int rayMask) const;
+			int intersect(const LeafTriangle& triangle, float *dist) const;
+		};
+
 		struct QuadNode
 		{
 			union { __m128 minx4; float minx[4]; };
@@ -41,18 +212,268 @@ namespace AGR
 			union { __m128 maxy4; float maxy[4]; };
 			union { __m128 maxz4; float maxz[4]; };
 			union { int child[4]; int isLeaf[4]; };
+			//two full cache lines per node
+			int reserved[4];
+			const static unsigned int LEAF_FLAG = 0x80000000;
+			static const int WIDTH = 4;
+			typedef RaySIMD RayType;
+			typedef RayPacket4 PacketType;
+			//bit mask of the children entered before maxDist, entry distances go to dist
+			int intersect(const RaySIMD& r, float maxDist, float *dist) const;
+			void decodeBounds(ChildBounds<4>& bounds) const;
+			//children are packed to the front, the rest of the slots stay empty
+			void setBounds(const AABB *children, int count);
+		};
+
+		//bounds are loaded unaligned, so the nodes need no 32 byte alignment
+		//neither in vectors nor in mapped cache files
+		struct OctNode
+		{
+			float minx[8];
+			float miny[8];
+			float minz[8];
+			float maxx[8];
+			float maxy[8];
+			float maxz[8];
+			union { int child[8]; int isLeaf[8]; };
+			const static unsigned int LEAF_FLAG = 0x80000000;
+			static const int WIDTH = 8;
+			typedef RaySIMD8 RayType;
+			typedef RayPacket8 PacketType;
+			int intersect(const RaySIMD8& r, float maxDist, float *dist) const;
+			void decodeBounds(ChildBounds<8>& bounds) const;
+			void setBounds(const AABB *children, int count);
+		};
+
+		//child bound i on an axis is origin + q[i] * 2^(exponent - 127),
+		//rounded outwards when quantized so it always contains the exact one
+		struct CompressedQuadNode
+		{
+			float origin[3];
+			unsigned char exponent[3];
+			unsigned char padding;
+			unsigned char qminx[4];
+			unsigned char qminy[4];
+			unsigned char qminz[4];
+			unsigned char qmaxx[4];
+			unsigned char qmaxy[4];
+			unsigned char qmaxz[4];
+			union { int child[4]; int isLeaf[4]; };
+			//a full cache line per node
+			int reserved[2];
+			const static unsigned int LEAF_FLAG = 0x80000000;
+			static const int WIDTH = 4;
+			typedef RaySIMD RayType;
+			typedef RayPacket4 PacketType;
+			int intersect(const RaySIMD& r, float maxDist, float *dist) const;
+			void decodeBounds(ChildBounds<4>& bounds) const;
+			void setBounds(const AABB *children, int count);
+			static __m128 decode(const unsigned char *q);
+		};
+
+		struct CompressedOctNode
+		{
+			float origin[3];
+			unsigned char exponent[3];
+			unsigned char padding;
+			unsigned char qminx[8];
+			unsigned char qminy[8];
+			unsigned char qminz[8];
+			unsigned char qmaxx[8];
+			unsigned char qmaxy[8];
+			unsigned char qmaxz[8];
+			union { int child[8]; int isLeaf[8]; };
 			const static unsigned int LEAF_FLAG = 0x80000000;
-			__m128 intersect(RaySIMD& r, __m128& dist) const;
+			static const int WIDTH = 8;
+			typedef RaySIMD8 RayType;
+			typedef RayPacket8 PacketType;
+			int intersect(const RaySIMD8& r, float maxDist, float *dist) const;
+			void decodeBounds(ChildBounds<8>& bounds) const;
+			void setBounds(const AABB *children, int count);
+			static __m256 decode(const unsigned char *q);
+		};
+
+		enum NodeLayout
+		{
+			QUAD_NODES,
+			OCT_NODES,
+			COMPRESSED_QUAD_NODES,
+			COMPRESSED_OCT_NODES
 		};
 
-		AABB getSurroundAABB(Primitive** primitives, size_t size) const;
-		size_t findSplit(Primitive** primitives, size_t size);
+		//nodes start on cache line boundaries, so each one spans as few lines as its size allows
+		static const size_t CACHE_LINE_SIZE = 64;
+		//layoutWideNodes packs hot subtrees into blocks of about a page
+		static const size_t LAYOUT_BLOCK_SIZE = 4096;
+		template<class WideNode>
+		using WideNodeVector = std::vector<WideNode, AlignedAllocator<WideNode, CACHE_LINE_SIZE>>;
+
+		template<class CompressedNode>
+		static void quantizeBounds(CompressedNode& node, const AABB *children, int count);
+		NodeLayout getNodeLayout() const;
+		static int getLayoutWidth(NodeLayout layout);
+		static size_t getNodeSize(NodeLayout layout);
+		template<class WideNode>
+		WideNode *getWideNodes() const { return reinterpret_cast<WideNode *>(m_wideNodesData); }
+		void clearWideNodes();
+
+		template<class BoxFunc>
+		static AABB reduceBounds(int size, const BoxFunc& box);
+		size_t findSplit(const ::uint64_t* codes, size_t size);
 		::uint64_t expandBits(::uint64_t v) const;
 		::uint64_t CalcMortonCode(glm::vec3& pt, glm::vec3& min, glm::vec3& max) const;
 		void sortPrimitivesByMortonCodes();
-		bool Traverse(Ray& ray, RaySIMD& rsimd, Intersection& intersect, QuadNode *node, float minLength);
-		void buildQuadTree(QuadNode* parent, Node **children);
-		void formQuadNode(Node *parent, Node **children);
+		static void radixSort(std::vector<::uint64_t>& keys, std::vector<int>& values, int keyBits);
+		struct StackEntry
+		{
+			int child;
+			float dist;
+		};
+
+		struct PacketStackEntry
+		{
+			int child;
+			//rays of the packet that entered the child
+			int rayMask;
+			//the nearest of their entry distances
+			float dist;
+		};
+
+		//stack of a traversal too deep for its local one, kept per thread and
+		//nesting level, since instances are traversed while the scene traversal
+		//still uses its stack, so it only grows instead of allocating per ray
+		template<class Entry>
+		class DeepStack
+		{
+		public:
+			DeepStack() : m_data(nullptr) {}
+			~DeepStack() { if (m_data) --getLevels().used; }
+			Entry *reserve(int capacity)
+			{
+				Levels& levels = getLevels();
+				if (levels.stacks.size() == levels.used) levels.stacks.emplace_back();
+				std::vector<Entry>& stack = levels.stacks[levels.used++];
+				if (static_cast<int>(stack.size()) < capacity) stack.resize(capacity);
+				m_data = stack.data();
+				return m_data;
+			}
+		private:
+			struct Levels
+			{
+				std::vector<std::vector<Entry>> stacks;
+				size_t used = 0;
+			};
+			static Levels& getLevels()
+			{
+				thread_local Levels levels;
+				return levels;
+			}
+			Entry *m_data;
+		};
+
+		static void initRaySIMD(const Ray& ray, const glm::vec3& invDirection, RaySIMD& rsimd);
+		static void initRaySIMD(const Ray& ray, const glm::vec3& invDirection, RaySIMD8& rsimd);
+		//false when the rays go different ways along an axis
+		static bool calcPacketFrustum(const float *orig, const float *invdir, int size, float *sign,
+			float *origLo, float *origHi, float *invdirLo, float *invdirHi);
+		//starts at root with the interval of the hit already in intersect
+		template<class Query, class Faces, class WideNode>
+		bool Traverse(const Ray& ray, const typename WideNode::RayType& rsimd,
+			Intersection& intersect, const WideNode *nodes, int root, float length) const;
+		//the 8 wide kernels for both oct layouts, in BVHAvx2.cpp
+		template<class Query, class Faces>
+		bool traverseOct(const Ray& ray, const glm::vec3& invDirection,
+			Intersection& intersect, float length) const;
+		void tracePacketsOct(const Ray *rays, Intersection *intersect, const int *order,
+			int count) const;
+		void traverseInterleavedOct(const Ray *rays, Intersection *intersect, int count) const;
+		//without an order the rays are taken as they are
+		void tracePackets(const std::vector<Ray>& rays, std::vector<Intersection>& intersect,
+			const int *order);
+		template<class WideNode>
+		void PacketTraverse(const Ray *rays, Intersection *intersect, const int *order,
+			int count, const WideNode *nodes) const;
+		template<class WideNode>
+		void traversePacket(const Ray *const *rays, Intersection *const *intersect, int count,
+			const WideNode *nodes) const;
+		template<class WideNode>
+		void InterleavedTraverse(const Ray *rays, Intersection *intersect, int count,
+			const WideNode *nodes) const;
+		//the whole node, or the primitive data of a leaf
+		template<class WideNode>
+		void prefetchChild(const WideNode *nodes, int child) const;
+		template<class WideNode>
+		void collapseTree(WideNodeVector<WideNode>& nodes);
+		template<class WideNode>
+		void buildWideTree(WideNode *nodes, int parentNum, Node **children, int depth);
+		template<class WideNode>
+		void layoutWideNodes(WideNodeVector<WideNode>& nodes);
+		void formWideNode(Node *parent, Node **children, int width);
+		int countWideNodes(Node *parent, int width);
+		bool isWideLeaf(const Node *node) const;
+		int createLeaf(const Node *node);
+		void collectLeafPrimitives(int nodeNum);
+		void setLeafCopies(int reference);
+		//hits closer than tmax only
+		template<class Query, class Faces>
+		bool intersectLeaf(const Ray& ray, unsigned int leaf, float tmax, Intersection& intersect) const;
+		AABB refitLeaf(unsigned int leaf);
+
+		static const int MAX_NODE_WIDTH = 8;
+		static const int MAX_LEAF_SIZE = 8;
+		//wide node leaf children hold the leaf flag, the primitives amount - 1,
+		//whether they are all triangles or all spheres and the first reference
+		//in the leaf arrays
+		static const int LEAF_SIZE_SHIFT = 28;
+		static const unsigned int TRIANGLE_LEAF_FLAG = 0x08000000;
+		static const unsigned int SPHERE_LEAF_FLAG = 0x04000000;
+		static const unsigned int LEAF_FIRST_MASK = 0x03ffffff;
+
+		//per reference type, mixed leaves are sorted by it and switch on it
+		//instead of calling the virtual intersect
+		enum LeafType : unsigned char
+		{
+			TRIANGLE_LEAF,
+			SPHERE_LEAF,
+			INSTANCE_LEAF,
+			OTHER_LEAF
+		};
+
+		struct CollapseCost
+		{
+			//indexed by the amount of slots the subtree may spread over
+			float cost[MAX_NODE_WIDTH + 1];
+			//slots given to the left child, 0 when the entry for one slot less is
+			//used, [0] is the split when the node itself becomes a wide node
+			char split[MAX_NODE_WIDTH + 1];
+			//a single slot is a leaf with all the primitives of the subtree
+			bool isLeaf;
+			int primitivesAm;
+		};
+
+		//Triangle::intersect data, copied next to each other in leaf order
+		struct LeafTriangle
+		{
+			glm::vec3 v0;
+			glm::vec3 v0v1;
+			glm::vec3 v0v2;
+			glm::vec3 normal;
+			float d00, d01, d11, invdenom;
+			float intersect(const Ray& r) const;
+		};
+
+		//Sphere::intersect data, same order as the triangle copies
+		struct LeafSphere
+		{
+			glm::vec3 center;
+			float radius2;
+			float intersect(const Ray& r) const;
+		};
+
+		static LeafType getLeafType(const Primitive *primitive);
+
+		void calcCollapseCosts(int nodeNum, int depth, int width);
+		void collectSlots(int nodeNum, int slots, Node **children, int& count);
 
 		struct NodePair
 		{
@@ -61,21 +482,170 @@ namespace AGR
 			float dist;
 		};
 
+		//a node of a cluster and its best match, both by slot and node number,
+		//which tells whether either was merged since
+		struct ClusterMatch
+		{
+			float dist;
+			int node;
+			int nodeNum;
+			int closest;
+			int closestNum;
+
+			bool operator>(const ClusterMatch& other) const { return dist > other.dist; }
+		};
+
+		//the bounds of the nodes of a cluster, with the area of a merge inlined
+		struct ClusterBounds
+		{
+			glm::vec3 minPt;
+			glm::vec3 maxPt;
+
+			float calcUnitedArea(const ClusterBounds& other) const
+			{
+				glm::vec3 dim = glm::max(maxPt, other.maxPt) - glm::min(minPt, other.minPt);
+				return (dim.x * (dim.y + dim.z) + dim.y * dim.z) * 2;
+			}
+		};
+
 		int BuildTreeAgglomerative(NodePair *nodesArr, int size);
 		void combineClusters(NodePair *nodesArr, int size,
 			int amount);
-		void findBestMatch(NodePair* node, NodePair *nodesArr, int count);
+		void findBestMatch(NodePair* node, NodePair *nodesArr, int count, const ClusterBounds *bounds);
 		int calcClusterSize(int amountOfNodes) const;
 
+		static const int SAH_BINS = 16;
+		static const int SAH_PARALLEL_THRESHOLD = 4096;
+
+		struct Bin
+		{
+			AABB bounds;
+			AABB centers;
+			int count;
+		};
+
+		void createLeafNodes();
+		void constructSingleLeaf();
+		void constructAgglomerative();
+		void constructPLOC();
+		void constructLBVH();
+		int commonPrefix(int i, int j) const;
+		float calcCost(int nodeNum, int depth, bool refit);
+		template<class WideNode>
+		AABB refitWideNode(WideNode *nodes, int nodeNum, int depth);
+		AABB refitWideNodes();
+		void collapseTree();
+
+		struct CacheHeader
+		{
+			char magic[4];
+			::uint32_t version;
+			::uint64_t hash;
+			::uint32_t nodeLayout;
+			::uint32_t nodeSize;
+			::int32_t primitivesAm;
+			::int32_t leafReferencesAm;
+			::int32_t nodesAm;
+			::int32_t depth;
+			float bounds[6];
+		};
+
+		::uint64_t calcGeometryHash(const std::vector<Primitive *>& primitives) const;
+		static void calcCacheLayout(int referencesAm, size_t& orderOffset, size_t& nodesOffset);
+		bool loadCache(const std::string& path, ::uint64_t hash,
+			const std::vector<Primitive *>& primitives);
+		void saveCache(const std::string& path, ::uint64_t hash,
+			const std::vector<Primitive *>& primitives) const;
+		void prepareUpdates();
+		int allocateNode();
+		void freeNode(int nodeNum);
+		int findBestSibling(const AABB& bounds) const;
+		int findLeaf(const Primitive *primitive) const;
+		void removeLeaf(int leaf);
+		void updateAncestors(int nodeNum);
+		void rotateNode(int nodeNum);
+		void optimizeTreelets();
+		void restructureTreelet(int root, std::vector<int>& parents, std::vector<float>& costs);
+		void constructBinnedSAH();
+
+		struct Reference
+		{
+			AABB bounds;
+			int primitiveNum;
+		};
+
+		void constructSBVH();
+		void buildSBVH(int nodeNum, std::vector<Reference>& refs);
+		void buildBinnedSAH(int nodeNum, int *indices, int first, int size, const AABB& centers);
+		void fillBins(const int *indices, int size, const AABB& centers, Bin *bins) const;
+
 
 		std::vector<Primitive *> m_primitives;
 		std::vector<Node> m_nodes;
-		std::vector<QuadNode> m_quadNodes;
-		int m_quadNodesCount = 0;
-		int m_nodesCount = 0;
+		//primitives of the wide node leaves in leaf order, references duplicated
+		//by spatial splits appear once per leaf
+		std::vector<Primitive *> m_leafPrimitives;
+		std::vector<LeafTriangle, AlignedAllocator<LeafTriangle, CACHE_LINE_SIZE>> m_leafTriangles;
+		std::vector<LeafSphere, AlignedAllocator<LeafSphere, CACHE_LINE_SIZE>> m_leafSpheres;
+		std::vector<LeafType> m_leafTypes;
+		int m_maxLeafSize = 4;
+		//only the vector of the built layout holds nodes, sized to fit exactly
+		WideNodeVector<QuadNode> m_quadNodes;
+		WideNodeVector<OctNode> m_octNodes;
+		WideNodeVector<CompressedQuadNode> m_compressedQuadNodes;
+		WideNodeVector<CompressedOctNode> m_compressedOctNodes;
+		//that vector or the nodes inside the mapped cache file
+		char *m_wideNodesData = nullptr;
+		NodeLayout m_wideNodesLayout = QUAD_NODES;
+		int m_wideNodesCount = 0;
+		//wide nodes on the longest root to leaf path, bounds the traversal stack
+		int m_wideTreeDepth = 0;
+		int m_nodeWidth = 4;
+		bool m_compressedNodes = false;
+		AABB m_bounds;
+		MappedFile m_cacheFile;
+		std::atomic<int> m_nodesCount{ 0 };
+		BuildMethod m_buildMethod = AGGLOMERATIVE;
+		int m_treeletPasses = 0;
+		float m_spatialSplitBudget = 0.3f;
+		std::atomic<int> m_splitBudget{ 0 };
+		float m_minSplitOverlap = 0.0f;
+		float m_builtCost = 0.0f;
+		float m_refitThreshold = 1.5f;
+		//only maintained once the tree is updated incrementally
+		std::vector<int> m_parents;
+		bool m_isWideTreeDirty = false;
+
+		//per primitive data used during construction
+		std::vector<AABB> m_primBounds;
+		std::vector<glm::vec3> m_primCenters;
+		std::vector<::uint64_t> m_mortonCodes;
+		std::vector<CollapseCost> m_collapseCosts;
 
-		static const size_t TREELET_SIZE = 7;
+		static const int TREELET_SIZE = 7;
 		static const size_t CLUSTER_SIZE = 20;
+		static const int MORTON_BITS = 60;
+		//cells per axis of the ray sorting, 2^bits of them over the scene for the
+		//origins and over [-1, 1] for the directions
+		static const int RAY_ORIGIN_BITS = 6;
+		static const int RAY_DIRECTION_BITS = 3;
+		static const int RADIX_BITS = 8;
+		static const int AAC_PARALLEL_THRESHOLD = 8192;
+		static const int PLOC_RADIUS = 16;
+		static const int PARALLEL_DEPTH = 6;
+		//entries on the stack of a traversal, deeper trees use a DeepStack
+		static const int TRAVERSAL_STACK_SIZE = 256;
+		//rays each thread has in flight during the interleaved traversal
+		static const int INTERLEAVED_RAYS = 8;
+		//packets with fewer active rays go on as single rays, the packet tests
+		//cost more than they save once the rays have spread out
+		static const int PACKET_MIN_RAYS = 3;
+		static const ::uint32_t CACHE_VERSION = 8;
+		static const int CACHE_ALIGNMENT = 64;
 		const float CLUSTERFUNC_EPSILON = 0.1f;
+		const float SAH_NODE_COST = 1.2f;
+		const float SAH_PRIMITIVE_COST = 1.0f;
+		//child overlap relative to the root area that enables spatial splits
+		const float SBVH_OVERLAP_THRESHOLD = 1e-5f;
 	};
 }
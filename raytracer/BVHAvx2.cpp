@@ -0,0 +1,282 @@
+#include "BVH.h"
+#include <algorithm>
+
+//BVH only calls into this file once the cpu was found to support AVX2 and FMA.
+//the file itself is built for the baseline and only the code from here on is
+//built for them, inline helpers of the headers above are emitted here as well
+//and the linker may keep either copy, so they must not use the new instructions
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2,fma"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#endif
+#include "BVHTraversal.h"
+
+namespace AGR
+{
+	template<class Query, class Faces>
+	bool BVH::traverseOct(const Ray& ray, const glm::vec3& invDirection,
+		Intersection& intersect, float length) const
+	{
+		RaySIMD8 rsimd;
+		initRaySIMD(ray, invDirection, rsimd);
+		if (m_wideNodesLayout == COMPRESSED_OCT_NODES) {
+			return Traverse<Query, Faces>(ray, rsimd, intersect,
+				getWideNodes<CompressedOctNode>(), 0, length);
+		}
+		return Traverse<Query, Faces>(ray, rsimd, intersect, getWideNodes<OctNode>(), 0, length);
+	}
+
+	void BVH::tracePacketsOct(const Ray *rays, Intersection *intersect, const int *order,
+		int count) const
+	{
+		if (m_wideNodesLayout == COMPRESSED_OCT_NODES) {
+			PacketTraverse(rays, intersect, order, count, getWideNodes<CompressedOctNode>());
+		} else {
+			PacketTraverse(rays, intersect, order, count, getWideNodes<OctNode>());
+		}
+	}
+
+	void BVH::traverseInterleavedOct(const Ray *rays, Intersection *intersect, int count) const
+	{
+		if (m_wideNodesLayout == COMPRESSED_OCT_NODES) {
+			InterleavedTraverse(rays, intersect, count, getWideNodes<CompressedOctNode>());
+		} else {
+			InterleavedTraverse(rays, intersect, count, getWideNodes<OctNode>());
+		}
+	}
+
+	void BVH::initRaySIMD(const Ray& ray, const glm::vec3& invDirection, RaySIMD8& rsimd)
+	{
+		rsimd.invdirx8 = _mm256_set1_ps(invDirection.x);
+		rsimd.invdiry8 = _mm256_set1_ps(invDirection.y);
+		rsimd.invdirz8 = _mm256_set1_ps(invDirection.z);
+		rsimd.origInvDirx8 = _mm256_set1_ps(ray.origin.x * invDirection.x);
+		rsimd.origInvDiry8 = _mm256_set1_ps(ray.origin.y * invDirection.y);
+		rsimd.origInvDirz8 = _mm256_set1_ps(ray.origin.z * invDirection.z);
+	}
+
+	int BVH::OctNode::intersect(const RaySIMD8& r, float maxDist, float *dist) const
+	{
+		//(bound - origin) * invdir as a single fused multiply subtract
+		__m256 t1x = _mm256_fmsub_ps(_mm256_loadu_ps(minx), r.invdirx8, r.origInvDirx8);
+		__m256 t1y = _mm256_fmsub_ps(_mm256_loadu_ps(miny), r.invdiry8, r.origInvDiry8);
+		__m256 t1z = _mm256_fmsub_ps(_mm256_loadu_ps(minz), r.invdirz8, r.origInvDirz8);
+		__m256 t2x = _mm256_fmsub_ps(_mm256_loadu_ps(maxx), r.invdirx8, r.origInvDirx8);
+		__m256 t2y = _mm256_fmsub_ps(_mm256_loadu_ps(maxy), r.invdiry8, r.origInvDiry8);
+		__m256 t2z = _mm256_fmsub_ps(_mm256_loadu_ps(maxz), r.invdirz8, r.origInvDirz8);
+		__m256 tmin = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(t1x, t2x),
+			_mm256_min_ps(t1y, t2y)), _mm256_min_ps(t1z, t2z));
+		__m256 tmax = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(t1x, t2x),
+			_mm256_max_ps(t1y, t2y)), _mm256_max_ps(t1z, t2z));
+		_mm256_storeu_ps(dist, tmin);
+		__m256 hit = _mm256_and_ps(_mm256_cmp_ps(tmax, tmin, _CMP_GT_OQ),
+			_mm256_cmp_ps(tmax, _mm256_setzero_ps(), _CMP_GT_OQ));
+		return _mm256_movemask_ps(_mm256_and_ps(hit,
+			_mm256_cmp_ps(tmin, _mm256_set1_ps(maxDist), _CMP_LT_OQ)));
+	}
+
+	void BVH::OctNode::decodeBounds(ChildBounds<8>& bounds) const
+	{
+		memcpy(bounds.min[0], minx, sizeof(minx));
+		memcpy(bounds.min[1], miny, sizeof(miny));
+		memcpy(bounds.min[2], minz, sizeof(minz));
+		memcpy(bounds.max[0], maxx, sizeof(maxx));
+		memcpy(bounds.max[1], maxy, sizeof(maxy));
+		memcpy(bounds.max[2], maxz, sizeof(maxz));
+	}
+
+	__m256 BVH::CompressedOctNode::decode(const unsigned char *q)
+	{
+		return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+			_mm_loadl_epi64(reinterpret_cast<const __m128i *>(q))));
+	}
+
+	int BVH::CompressedOctNode::intersect(const RaySIMD8& r, float maxDist, float *dist) const
+	{
+		__m256 scalex = _mm256_castsi256_ps(_mm256_set1_epi32(exponent[0] << 23));
+		__m256 scaley = _mm256_castsi256_ps(_mm256_set1_epi32(exponent[1] << 23));
+		__m256 scalez = _mm256_castsi256_ps(_mm256_set1_epi32(exponent[2] << 23));
+		__m256 originx = _mm256_set1_ps(origin[0]);
+		__m256 originy = _mm256_set1_ps(origin[1]);
+		__m256 originz = _mm256_set1_ps(origin[2]);
+		__m256 t1x = _mm256_fmsub_ps(_mm256_fmadd_ps(decode(qminx), scalex, originx), r.invdirx8, r.origInvDirx8);
+		__m256 t1y = _mm256_fmsub_ps(_mm256_fmadd_ps(decode(qminy), scaley, originy), r.invdiry8, r.origInvDiry8);
+		__m256 t1z = _mm256_fmsub_ps(_mm256_fmadd_ps(decode(qminz), scalez, originz), r.invdirz8, r.origInvDirz8);
+		__m256 t2x = _mm256_fmsub_ps(_mm256_fmadd_ps(decode(qmaxx), scalex, originx), r.invdirx8, r.origInvDirx8);
+		__m256 t2y = _mm256_fmsub_ps(_mm256_fmadd_ps(decode(qmaxy), scaley, originy), r.invdiry8, r.origInvDiry8);
+		__m256 t2z = _mm256_fmsub_ps(_mm256_fmadd_ps(decode(qmaxz), scalez, originz), r.invdirz8, r.origInvDirz8);
+		__m256 tmin = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(t1x, t2x),
+			_mm256_min_ps(t1y, t2y)), _mm256_min_ps(t1z, t2z));
+		__m256 tmax = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(t1x, t2x),
+			_mm256_max_ps(t1y, t2y)), _mm256_max_ps(t1z, t2z));
+		_mm256_storeu_ps(dist, tmin);
+		__m256 hit = _mm256_and_ps(_mm256_cmp_ps(tmax, tmin, _CMP_GT_OQ),
+			_mm256_cmp_ps(tmax, _mm256_setzero_ps(), _CMP_GT_OQ));
+		return _mm256_movemask_ps(_mm256_and_ps(hit,
+			_mm256_cmp_ps(tmin, _mm256_set1_ps(maxDist), _CMP_LT_OQ)));
+	}
+
+	void BVH::CompressedOctNode::decodeBounds(ChildBounds<8>& bounds) const
+	{
+		const unsigned char *qmin[3] = { qminx, qminy, qminz };
+		const unsigned char *qmax[3] = { qmaxx, qmaxy, qmaxz };
+		for (int axis = 0; axis < 3; ++axis) {
+			__m256 scale = _mm256_castsi256_ps(_mm256_set1_epi32(exponent[axis] << 23));
+			__m256 base = _mm256_set1_ps(origin[axis]);
+			_mm256_storeu_ps(bounds.min[axis], _mm256_fmadd_ps(decode(qmin[axis]), scale, base));
+			_mm256_storeu_ps(bounds.max[axis], _mm256_fmadd_ps(decode(qmax[axis]), scale, base));
+		}
+	}
+
+	void BVH::RayPacket8::init(const Ray *const *r, int count)
+	{
+		union { __m256 v; float f[8]; } orig[3], dir[3], invdir[3];
+		for (int k = 0; k < SIZE; ++k) {
+			const Ray& ray = *r[k < count ? k : 0];
+			for (int axis = 0; axis < 3; ++axis) {
+				orig[axis].f[k] = ray.origin[axis];
+				dir[axis].f[k] = ray.direction[axis];
+				invdir[axis].f[k] = 1.0f / ray.direction[axis];
+			}
+		}
+		origx8 = orig[0].v;
+		origy8 = orig[1].v;
+		origz8 = orig[2].v;
+		dirx8 = dir[0].v;
+		diry8 = dir[1].v;
+		dirz8 = dir[2].v;
+		rays.invdirx8 = invdir[0].v;
+		rays.invdiry8 = invdir[1].v;
+		rays.invdirz8 = invdir[2].v;
+		rays.origInvDirx8 = _mm256_mul_ps(orig[0].v, invdir[0].v);
+		rays.origInvDiry8 = _mm256_mul_ps(orig[1].v, invdir[1].v);
+		rays.origInvDirz8 = _mm256_mul_ps(orig[2].v, invdir[2].v);
+		tmax8 = _mm256_set1_ps(FLT_MAX);
+		float sign[3], origLo[3], origHi[3], invdirLo[3], invdirHi[3];
+		hasFrustum = calcPacketFrustum(&orig[0].f[0], &invdir[0].f[0], SIZE,
+			sign, origLo, origHi, invdirLo, invdirHi);
+		for (int axis = 0; axis < 3; ++axis) {
+			nearSide[axis] = sign[axis] < 0.0f;
+			sign8[axis] = _mm256_set1_ps(sign[axis]);
+			origLo8[axis] = _mm256_set1_ps(origLo[axis]);
+			origHi8[axis] = _mm256_set1_ps(origHi[axis]);
+			invdirLo8[axis] = _mm256_set1_ps(invdirLo[axis]);
+			invdirHi8[axis] = _mm256_set1_ps(invdirHi[axis]);
+		}
+	}
+
+	int BVH::RayPacket8::activeRays(float dist) const
+	{
+		return _mm256_movemask_ps(_mm256_cmp_ps(tmax8, _mm256_set1_ps(dist), _CMP_GT_OQ));
+	}
+
+	int BVH::RayPacket8::intersect(const ChildBounds<8>& bounds, int child, int rayMask,
+		float& nearest) const
+	{
+		__m256 t1x = _mm256_fmsub_ps(_mm256_set1_ps(bounds.min[0][child]), rays.invdirx8, rays.origInvDirx8);
+		__m256 t1y = _mm256_fmsub_ps(_mm256_set1_ps(bounds.min[1][child]), rays.invdiry8, rays.origInvDiry8);
+		__m256 t1z = _mm256_fmsub_ps(_mm256_set1_ps(bounds.min[2][child]), rays.invdirz8, rays.origInvDirz8);
+		__m256 t2x = _mm256_fmsub_ps(_mm256_set1_ps(bounds.max[0][child]), rays.invdirx8, rays.origInvDirx8);
+		__m256 t2y = _mm256_fmsub_ps(_mm256_set1_ps(bounds.max[1][child]), rays.invdiry8, rays.origInvDiry8);
+		__m256 t2z = _mm256_fmsub_ps(_mm256_set1_ps(bounds.max[2][child]), rays.invdirz8, rays.origInvDirz8);
+		__m256 tmin = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(t1x, t2x),
+			_mm256_min_ps(t1y, t2y)), _mm256_min_ps(t1z, t2z));
+		__m256 tmaxBox = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(t1x, t2x),
+			_mm256_max_ps(t1y, t2y)), _mm256_max_ps(t1z, t2z));
+		__m256i lanes = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+		__m256 hit = _mm256_castsi256_ps(_mm256_cmpeq_epi32(
+			_mm256_and_si256(_mm256_set1_epi32(rayMask), lanes), lanes));
+		hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(tmaxBox, tmin, _CMP_GT_OQ),
+			_mm256_cmp_ps(tmaxBox, _mm256_setzero_ps(), _CMP_GT_OQ)));
+		hit = _mm256_and_ps(hit, _mm256_cmp_ps(tmin, tmax8, _CMP_LT_OQ));
+		__m256 dist = _mm256_blendv_ps(_mm256_set1_ps(FLT_MAX), tmin, hit);
+		__m128 half = _mm_min_ps(_mm256_castps256_ps128(dist), _mm256_extractf128_ps(dist, 1));
+		half = _mm_min_ps(half, _mm_shuffle_ps(half, half, _MM_SHUFFLE(1, 0, 3, 2)));
+		half = _mm_min_ps(half, _mm_shuffle_ps(half, half, _MM_SHUFFLE(2, 3, 0, 1)));
+		nearest = _mm_cvtss_f32(half);
+		return _mm256_movemask_ps(hit);
+	}
+
+	int BVH::RayPacket8::cull(const ChildBounds<8>& bounds, int rayMask) const
+	{
+		if (!hasFrustum) return (1 << SIZE) - 1;
+		__m256 entryDist = _mm256_set1_ps(-FLT_MAX);
+		__m256 exitDist = _mm256_set1_ps(FLT_MAX);
+		for (int axis = 0; axis < 3; ++axis) {
+			const float *nearPlanes = nearSide[axis] ? bounds.max[axis] : bounds.min[axis];
+			const float *farPlanes = nearSide[axis] ? bounds.min[axis] : bounds.max[axis];
+			__m256 nearDist = _mm256_fmsub_ps(_mm256_loadu_ps(nearPlanes), sign8[axis], origHi8[axis]);
+			__m256 farDist = _mm256_fmsub_ps(_mm256_loadu_ps(farPlanes), sign8[axis], origLo8[axis]);
+			entryDist = _mm256_max_ps(entryDist, _mm256_min_ps(_mm256_mul_ps(nearDist, invdirLo8[axis]),
+				_mm256_mul_ps(nearDist, invdirHi8[axis])));
+			exitDist = _mm256_min_ps(exitDist, _mm256_max_ps(_mm256_mul_ps(farDist, invdirLo8[axis]),
+				_mm256_mul_ps(farDist, invdirHi8[axis])));
+		}
+		float maxLength = 0.0f;
+		for (int k = 0; k < SIZE; ++k) {
+			if ((rayMask & (1 << k)) && tmax[k] > maxLength) maxLength = tmax[k];
+		}
+		__m256 hit = _mm256_and_ps(_mm256_cmp_ps(exitDist, entryDist, _CMP_GT_OQ),
+			_mm256_cmp_ps(exitDist, _mm256_setzero_ps(), _CMP_GT_OQ));
+		return _mm256_movemask_ps(_mm256_and_ps(hit,
+			_mm256_cmp_ps(entryDist, _mm256_set1_ps(maxLength), _CMP_LT_OQ)));
+	}
+
+	int BVH::RayPacket8::intersect(const LeafTriangle& triangle, float *dist) const
+	{
+		//no fused multiply adds, they would round differently than the scalar version
+		__m256 one = _mm256_set1_ps(1.0f);
+		__m256 zero = _mm256_setzero_ps();
+		__m256 nx = _mm256_set1_ps(triangle.normal.x);
+		__m256 ny = _mm256_set1_ps(triangle.normal.y);
+		__m256 nz = _mm256_set1_ps(triangle.normal.z);
+		__m256 denom = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dirx8, nx), _mm256_mul_ps(diry8, ny)),
+			_mm256_mul_ps(dirz8, nz));
+		__m256 absDenom = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), denom);
+		__m256 valid = _mm256_cmp_ps(absDenom, _mm256_set1_ps(FLT_EPSILON), _CMP_NLT_UQ);
+		__m256 v0x = _mm256_set1_ps(triangle.v0.x);
+		__m256 v0y = _mm256_set1_ps(triangle.v0.y);
+		__m256 v0z = _mm256_set1_ps(triangle.v0.z);
+		__m256 t = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(v0x, origx8), nx),
+			_mm256_mul_ps(_mm256_sub_ps(v0y, origy8), ny)), _mm256_mul_ps(_mm256_sub_ps(v0z, origz8), nz)), denom);
+		valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, zero, _CMP_NLT_UQ));
+		__m256 px = _mm256_sub_ps(_mm256_add_ps(origx8, _mm256_mul_ps(dirx8, t)), v0x);
+		__m256 py = _mm256_sub_ps(_mm256_add_ps(origy8, _mm256_mul_ps(diry8, t)), v0y);
+		__m256 pz = _mm256_sub_ps(_mm256_add_ps(origz8, _mm256_mul_ps(dirz8, t)), v0z);
+		__m256 d20 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, _mm256_set1_ps(triangle.v0v1.x)),
+			_mm256_mul_ps(py, _mm256_set1_ps(triangle.v0v1.y))), _mm256_mul_ps(pz, _mm256_set1_ps(triangle.v0v1.z)));
+		__m256 d21 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, _mm256_set1_ps(triangle.v0v2.x)),
+			_mm256_mul_ps(py, _mm256_set1_ps(triangle.v0v2.y))), _mm256_mul_ps(pz, _mm256_set1_ps(triangle.v0v2.z)));
+		__m256 d00 = _mm256_set1_ps(triangle.d00);
+		__m256 d01 = _mm256_set1_ps(triangle.d01);
+		__m256 d11 = _mm256_set1_ps(triangle.d11);
+		__m256 invdenom = _mm256_set1_ps(triangle.invdenom);
+		__m256 u = _mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(d11, d20), _mm256_mul_ps(d01, d21)), invdenom);
+		valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_NLT_UQ),
+			_mm256_cmp_ps(u, one, _CMP_NGT_UQ)));
+		__m256 v = _mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(d00, d21), _mm256_mul_ps(d01, d20)), invdenom);
+		valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_NLT_UQ),
+			_mm256_cmp_ps(_mm256_add_ps(v, u), one, _CMP_NGT_UQ)));
+		valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, zero, _CMP_GT_OQ),
+			_mm256_cmp_ps(t, tmax8, _CMP_LT_OQ)));
+		_mm256_storeu_ps(dist, t);
+		return _mm256_movemask_ps(valid);
+	}
+
+	template bool BVH::traverseOct<BVH::ClosestHit, BVH::AllFaces>(const Ray&, const glm::vec3&,
+		Intersection&, float) const;
+	template bool BVH::traverseOct<BVH::ClosestHit, BVH::NoBackfaces>(const Ray&, const glm::vec3&,
+		Intersection&, float) const;
+	template bool BVH::traverseOct<BVH::AnyHit, BVH::AllFaces>(const Ray&, const glm::vec3&,
+		Intersection&, float) const;
+	template bool BVH::traverseOct<BVH::AnyHit, BVH::NoBackfaces>(const Ray&, const glm::vec3&,
+		Intersection&, float) const;
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
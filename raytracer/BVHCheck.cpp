@@ -0,0 +1,141 @@
+#include "BVHCheck.h"
+#include "BVH.h"
+#include "util.h"
+#include "renederables/Triangle.h"
+#include "renederables/Sphere.h"
+#include "renederables/Mesh.h"
+#include "renederables/MeshInstance.h"
+#include <random>
+#include <vector>
+
+namespace AGR
+{
+	//relative to the distance, the copies of the bvh leaves round differently
+	static const float CHECK_TOLERANCE = 1e-4f;
+	static const int CHECK_INSTANCES = 4;
+
+	//closest hit of testing every primitive, -1 without one
+	static float traceAll(const std::vector<Primitive *>& primitives, const Ray& ray, bool cullsBackfaces)
+	{
+		float closest = -1.0f;
+		for (Primitive *primitive : primitives) {
+			const Triangle *triangle = primitive->asTriangle();
+			if (cullsBackfaces && triangle && glm::dot(ray.direction, triangle->getFaceNormal()) > 0) continue;
+			float dist = primitive->intersect(ray);
+			if (dist > 0 && (closest < 0 || dist < closest)) closest = dist;
+		}
+		return closest;
+	}
+
+	static bool isSameHit(float expected, bool wasHit, float dist)
+	{
+		if ((expected > 0) != wasHit) return false;
+		return !wasHit || glm::abs(dist - expected) <= CHECK_TOLERANCE * glm::max(1.0f, expected);
+	}
+
+	static Triangle *createTriangle(std::mt19937& gen, const glm::vec3& center, float size, Material& m)
+	{
+		std::uniform_real_distribution<float> offset(-size, size);
+		Vertex v[3];
+		for (int i = 0; i < 3; ++i) {
+			v[i].position = center + glm::vec3(offset(gen), offset(gen), offset(gen));
+		}
+		return new Triangle(v[0], v[1], v[2], m);
+	}
+
+	int checkBVH(int primitivesAm, int raysAm)
+	{
+		const BVH::BuildMethod methods[] = { BVH::AGGLOMERATIVE, BVH::BINNED_SAH, BVH::PLOC,
+			BVH::LBVH, BVH::SBVH };
+		std::mt19937 gen(1);
+		std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+		Material material;
+		int mismatches = 0;
+		for (int withInstances = 0; withInstances < 2; ++withInstances) {
+			//the scene the bvh is built over and the same surfaces for testing
+			//every primitive, with the instances as transformed triangles
+			std::vector<Primitive *> scene;
+			std::vector<Primitive *> flat;
+			std::vector<Primitive *> owned;
+			for (int i = 0; i < primitivesAm; ++i) {
+				glm::vec3 center = glm::vec3(unit(gen), unit(gen), unit(gen)) * 10.0f;
+				Primitive *primitive = i % 10 == 9 ? static_cast<Primitive *>(new Sphere(material, center, 0.3f))
+					: createTriangle(gen, center, 0.5f, material);
+				scene.push_back(primitive);
+				flat.push_back(primitive);
+				owned.push_back(primitive);
+			}
+			Mesh mesh(material);
+			std::vector<MeshInstance *> instances;
+			if (withInstances) {
+				for (int i = 0; i < primitivesAm / 10; ++i) {
+					mesh.addTriangle(createTriangle(gen, glm::vec3(unit(gen), unit(gen), unit(gen)), 0.2f, material));
+				}
+				for (int i = 0; i < CHECK_INSTANCES; ++i) {
+					glm::vec3 position = glm::vec3(unit(gen), unit(gen), unit(gen)) * 8.0f;
+					glm::vec3 rotation = glm::vec3(unit(gen), unit(gen), unit(gen)) * 3.0f;
+					glm::vec3 scale = glm::vec3(1.25f) + glm::vec3(unit(gen), unit(gen), unit(gen)) * 0.75f;
+					MeshInstance *instance = new MeshInstance(mesh);
+					instance->setPosition(position);
+					instance->setRotation(rotation);
+					instance->setScale(scale);
+					instance->commitTransformations();
+					instances.push_back(instance);
+					scene.push_back(instance);
+					glm::mat4x4 modMatrix;
+					transformMat(position, rotation, scale, modMatrix);
+					for (const Triangle *t : mesh.getTriangles()) {
+						Vertex v[3];
+						for (int k = 0; k < 3; ++k) {
+							v[k].position = glm::vec3(modMatrix * glm::vec4(t->getVertex(k).position, 1));
+						}
+						Triangle *moved = new Triangle(v[0], v[1], v[2], material);
+						flat.push_back(moved);
+						owned.push_back(moved);
+					}
+				}
+			}
+			std::vector<Ray> rays(raysAm);
+			std::vector<float> closest(raysAm);
+			std::vector<float> closestFront(raysAm);
+			for (int i = 0; i < raysAm; ++i) {
+				Ray& ray = rays[i];
+				ray.origin = glm::vec3(unit(gen), unit(gen), unit(gen)) * 15.0f;
+				ray.direction = glm::normalize(glm::vec3(unit(gen), unit(gen), unit(gen)) * 10.0f - ray.origin);
+				closest[i] = traceAll(flat, ray, false);
+				closestFront[i] = traceAll(flat, ray, true);
+			}
+			for (BVH::BuildMethod method : methods) {
+				for (int width = 4; width <= 8; width += 4) {
+					for (int compressed = 0; compressed < 2; ++compressed) {
+						BVH bvh;
+						bvh.setBuildMethod(method);
+						bvh.setNodeWidth(width);
+						bvh.setCompressedNodes(compressed != 0);
+						bvh.construct(scene);
+						for (int i = 0; i < raysAm; ++i) {
+							Intersection hit;
+							hit.ray_length = -1.0f;
+							bool wasHit = bvh.Traverse(rays[i], hit);
+							if (!isSameHit(closest[i], wasHit, hit.ray_length)) ++mismatches;
+							hit.ray_length = -1.0f;
+							wasHit = bvh.Traverse<BVH::ClosestHit, BVH::NoBackfaces>(rays[i], hit);
+							if (!isSameHit(closestFront[i], wasHit, hit.ray_length)) ++mismatches;
+							//just past and just short of the closest hit
+							float length = closest[i] > 0 ? closest[i] * (i % 2 ? 1.01f : 0.99f) : 50.0f;
+							if (bvh.CheckOcclusion(rays[i], length) != (closest[i] > 0 && closest[i] < length)) ++mismatches;
+						}
+						std::vector<Intersection> hits;
+						bvh.PacketTraverse(rays, hits);
+						for (int i = 0; i < raysAm; ++i) {
+							if (!isSameHit(closest[i], hits[i].ray_length > 0, hits[i].ray_length)) ++mismatches;
+						}
+					}
+				}
+			}
+			for (MeshInstance *instance : instances) delete instance;
+			for (Primitive *primitive : owned) delete primitive;
+		}
+		return mismatches;
+	}
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+namespace AGR
+{
+	//traces random rays through random scenes of triangles, spheres and mesh
+	//instances, built with every build method into every node layout, and
+	//compares the closest hits, the hits of packets, the hits without back
+	//faces and the occlusion tests with testing every primitive, returns the
+	//number of rays the bvh answered differently
+	int checkBVH(int primitivesAm = 2000, int raysAm = 500);
+}
@@ -0,0 +1,302 @@
+#pragma once
+#include "BVH.h"
+
+//traversal templates shared by BVH.cpp and BVHAvx2.cpp, each file instantiates
+//them only for the node layouts its instruction set can run
+namespace AGR
+{
+	template<class Query, class Faces, class WideNode>
+	bool BVH::Traverse(const Ray& ray, const typename WideNode::RayType& rsimd,
+		Intersection& intersect, const WideNode *nodes, int root, float length) const
+	{
+		//children still to visit with their entry distances, the nearest on top
+		StackEntry localStack[TRAVERSAL_STACK_SIZE];
+		DeepStack<StackEntry> deepStack;
+		StackEntry *stack = localStack;
+		int stackCapacity = m_wideTreeDepth * (WideNode::WIDTH - 1) + 1;
+		if (stackCapacity > TRAVERSAL_STACK_SIZE) {
+			//only degenerate trees get this deep
+			stack = deepStack.reserve(stackCapacity);
+		}
+		//the ray interval is [0, tmax], for the closest hit it shrinks to every closer hit
+		float tmax = intersect.ray_length > 0 ? glm::min(intersect.ray_length, length) : length;
+		bool wasHit = false;
+		stack[0].child = root;
+		stack[0].dist = 0.0f;
+		int stackSize = 1;
+		while (stackSize > 0) {
+			StackEntry entry = stack[--stackSize];
+			//pushed before a closer hit was found
+			if (!Query::IS_ANY_HIT && entry.dist >= tmax) continue;
+			if (entry.child & WideNode::LEAF_FLAG) {
+				if (intersectLeaf<Query, Faces>(ray, entry.child, tmax, intersect)) {
+					if (Query::IS_ANY_HIT) return true;
+					wasHit = true;
+					tmax = intersect.ray_length;
+				}
+				continue;
+			}
+			const WideNode *node = &nodes[entry.child];
+			float dist[WideNode::WIDTH];
+			int intersectFlags = node->intersect(rsimd, tmax, dist);
+			if (Query::IS_ANY_HIT) {
+				//any hit ends the query, so the order does not matter
+				for (int i = 0; i < WideNode::WIDTH; ++i) {
+					if (!(intersectFlags & (1 << i))) continue;
+					stack[stackSize].child = node->child[i];
+					stack[stackSize].dist = dist[i];
+					++stackSize;
+				}
+				continue;
+			}
+			//farthest children are pushed first, so the nearest is visited next,
+			//an insertion sort is the cheapest for the few children hit at once
+			int order[WideNode::WIDTH];
+			int hitAm = 0;
+			for (int i = 0; i < WideNode::WIDTH; ++i) {
+				if (!(intersectFlags & (1 << i))) continue;
+				int j = hitAm++;
+				while (j > 0 && dist[order[j - 1]] < dist[i]) {
+					order[j] = order[j - 1];
+					--j;
+				}
+				order[j] = i;
+			}
+			for (int k = 0; k < hitAm; ++k) {
+				stack[stackSize].child = node->child[order[k]];
+				stack[stackSize].dist = dist[order[k]];
+				++stackSize;
+			}
+		}
+		return wasHit;
+	}
+
+	template<class WideNode>
+	void BVH::InterleavedTraverse(const Ray *rays, Intersection *intersect, int count,
+		const WideNode *nodes) const
+	{
+		//the same steps as Traverse, only spread over several rays
+		struct RayState
+		{
+			typename WideNode::RayType rsimd;
+			int ray;
+			float tmax;
+			StackEntry *stack;
+			int stackSize;
+		};
+		StackEntry localStack[INTERLEAVED_RAYS * TRAVERSAL_STACK_SIZE];
+		DeepStack<StackEntry> deepStack;
+		StackEntry *stacks = localStack;
+		int stackCapacity = m_wideTreeDepth * (WideNode::WIDTH - 1) + 1;
+		if (stackCapacity > TRAVERSAL_STACK_SIZE) {
+			stacks = deepStack.reserve(INTERLEAVED_RAYS * stackCapacity);
+		} else {
+			stackCapacity = TRAVERSAL_STACK_SIZE;
+		}
+		RayState states[INTERLEAVED_RAYS];
+		int nextRay = 0;
+		int activeAm = 0;
+		auto startRay = [&](RayState& state) {
+			state.ray = nextRay++;
+			const Ray& ray = rays[state.ray];
+			initRaySIMD(ray, 1.0f / ray.direction, state.rsimd);
+			intersect[state.ray].ray_length = -1.0f;
+			state.tmax = FLT_MAX;
+			state.stack[0].child = 0;
+			state.stack[0].dist = 0.0f;
+			state.stackSize = 1;
+		};
+		for (int s = 0; s < INTERLEAVED_RAYS; ++s) {
+			states[s].stack = stacks + s * stackCapacity;
+			states[s].stackSize = 0;
+			if (nextRay < count) {
+				startRay(states[s]);
+				++activeAm;
+			}
+		}
+		while (activeAm > 0) {
+			for (int s = 0; s < INTERLEAVED_RAYS; ++s) {
+				RayState& state = states[s];
+				if (state.stackSize == 0) continue;
+				StackEntry entry = state.stack[--state.stackSize];
+				if (entry.child & WideNode::LEAF_FLAG) {
+					if (intersectLeaf<ClosestHit, AllFaces>(rays[state.ray], entry.child,
+						state.tmax, intersect[state.ray])) {
+						state.tmax = intersect[state.ray].ray_length;
+					}
+				} else {
+					const WideNode *node = &nodes[entry.child];
+					float dist[WideNode::WIDTH];
+					int intersectFlags = node->intersect(state.rsimd, state.tmax, dist);
+					int order[WideNode::WIDTH];
+					int hitAm = 0;
+					for (int i = 0; i < WideNode::WIDTH; ++i) {
+						if (!(intersectFlags & (1 << i))) continue;
+						int j = hitAm++;
+						while (j > 0 && dist[order[j - 1]] < dist[i]) {
+							order[j] = order[j - 1];
+							--j;
+						}
+						order[j] = i;
+					}
+					for (int k = 0; k < hitAm; ++k) {
+						state.stack[state.stackSize].child = node->child[order[k]];
+						state.stack[state.stackSize].dist = dist[order[k]];
+						++state.stackSize;
+					}
+				}
+				//entries pushed before a closer hit was found are dropped right
+				//away, so no step or prefetch is spent on them
+				while (state.stackSize > 0 &&
+					state.stack[state.stackSize - 1].dist >= state.tmax) --state.stackSize;
+				if (state.stackSize > 0) {
+					//it arrives while the other rays take their steps
+					prefetchChild(nodes, state.stack[state.stackSize - 1].child);
+				} else if (nextRay < count) {
+					startRay(state);
+				} else {
+					--activeAm;
+				}
+			}
+		}
+	}
+
+	template<class WideNode>
+	void BVH::prefetchChild(const WideNode *nodes, int child) const
+	{
+		const char *data;
+		size_t size;
+		if (!(child & WideNode::LEAF_FLAG)) {
+			data = reinterpret_cast<const char *>(&nodes[child]);
+			size = sizeof(WideNode);
+		} else {
+			int first = child & LEAF_FIRST_MASK;
+			int leafSize = ((child >> LEAF_SIZE_SHIFT) & (MAX_LEAF_SIZE - 1)) + 1;
+			if (child & TRIANGLE_LEAF_FLAG) {
+				data = reinterpret_cast<const char *>(&m_leafTriangles[first]);
+				size = leafSize * sizeof(LeafTriangle);
+			} else if (child & SPHERE_LEAF_FLAG) {
+				data = reinterpret_cast<const char *>(&m_leafSpheres[first]);
+				size = leafSize * sizeof(LeafSphere);
+			} else {
+				data = reinterpret_cast<const char *>(&m_leafPrimitives[first]);
+				size = leafSize * sizeof(Primitive *);
+			}
+		}
+		for (size_t offset = 0; offset < size; offset += CACHE_LINE_SIZE) {
+			_mm_prefetch(data + offset, _MM_HINT_T0);
+		}
+	}
+
+	template<class WideNode>
+	void BVH::PacketTraverse(const Ray *rays, Intersection *intersect, const int *order,
+		int count, const WideNode *nodes) const
+	{
+		const int packetSize = WideNode::PacketType::SIZE;
+		const Ray *packetRays[packetSize];
+		Intersection *packetIntersect[packetSize];
+		for (int first = 0; first < count; first += packetSize) {
+			int size = std::min(packetSize, count - first);
+			for (int k = 0; k < size; ++k) {
+				int i = order ? order[first + k] : first + k;
+				packetRays[k] = &rays[i];
+				packetIntersect[k] = &intersect[i];
+			}
+			traversePacket(packetRays, packetIntersect, size, nodes);
+		}
+	}
+
+	template<class WideNode>
+	void BVH::traversePacket(const Ray *const *rays, Intersection *const *intersect, int count,
+		const WideNode *nodes) const
+	{
+		typedef typename WideNode::PacketType RayPacket;
+		RayPacket packet;
+		packet.init(rays, count);
+		for (int k = 0; k < count; ++k) intersect[k]->ray_length = -1.0f;
+		PacketStackEntry localStack[TRAVERSAL_STACK_SIZE];
+		DeepStack<PacketStackEntry> deepStack;
+		PacketStackEntry *stack = localStack;
+		int stackCapacity = m_wideTreeDepth * (WideNode::WIDTH - 1) + 1;
+		if (stackCapacity > TRAVERSAL_STACK_SIZE) {
+			stack = deepStack.reserve(stackCapacity);
+		}
+		stack[0].child = 0;
+		stack[0].rayMask = (1 << count) - 1;
+		stack[0].dist = 0.0f;
+		int stackSize = 1;
+		ChildBounds<WideNode::WIDTH> bounds;
+		while (stackSize > 0) {
+			PacketStackEntry entry = stack[--stackSize];
+			//without the rays that found a hit closer than the child since it was pushed
+			int rayMask = entry.rayMask & packet.activeRays(entry.dist);
+			if (!rayMask) continue;
+			if ((entry.child & WideNode::LEAF_FLAG) && (entry.child & TRIANGLE_LEAF_FLAG)) {
+				//each triangle against all the rays at once
+				int first = entry.child & LEAF_FIRST_MASK;
+				int last = first + ((entry.child >> LEAF_SIZE_SHIFT) & (MAX_LEAF_SIZE - 1)) + 1;
+				for (int i = first; i < last; ++i) {
+					float dist[RayPacket::SIZE];
+					int hitMask = packet.intersect(m_leafTriangles[i], dist) & rayMask;
+					for (int k = 0; k < RayPacket::SIZE; ++k) {
+						if (!(hitMask & (1 << k))) continue;
+						packet.tmax[k] = dist[k];
+						intersect[k]->ray_length = dist[k];
+						intersect[k]->p_object = m_leafPrimitives[i];
+						intersect[k]->primitive_index = i;
+					}
+				}
+				continue;
+			}
+			if (entry.child & WideNode::LEAF_FLAG) {
+				for (int k = 0; k < RayPacket::SIZE; ++k) {
+					if ((rayMask & (1 << k)) && intersectLeaf<ClosestHit, AllFaces>(*rays[k],
+						entry.child, packet.tmax[k], *intersect[k])) {
+						packet.tmax[k] = intersect[k]->ray_length;
+					}
+				}
+				continue;
+			}
+			int activeAm = 0;
+			for (int k = 0; k < RayPacket::SIZE; ++k) activeAm += (rayMask >> k) & 1;
+			if (activeAm < PACKET_MIN_RAYS) {
+				//the packet lost its coherence, the few rays left finish the subtree alone
+				for (int k = 0; k < RayPacket::SIZE; ++k) {
+					if (!(rayMask & (1 << k))) continue;
+					typename WideNode::RayType rsimd;
+					initRaySIMD(*rays[k], 1.0f / rays[k]->direction, rsimd);
+					if (Traverse<ClosestHit, AllFaces>(*rays[k], rsimd, *intersect[k], nodes,
+						entry.child, FLT_MAX)) {
+						packet.tmax[k] = intersect[k]->ray_length;
+					}
+				}
+				continue;
+			}
+			const WideNode *node = &nodes[entry.child];
+			node->decodeBounds(bounds);
+			int childMask = packet.cull(bounds, rayMask);
+			//farthest children are pushed first, so the nearest is visited next
+			int order[WideNode::WIDTH];
+			int childRays[WideNode::WIDTH];
+			float childDist[WideNode::WIDTH];
+			int hitAm = 0;
+			for (int i = 0; i < WideNode::WIDTH; ++i) {
+				if (!(childMask & (1 << i))) continue;
+				childRays[i] = packet.intersect(bounds, i, rayMask, childDist[i]);
+				if (!childRays[i]) continue;
+				int j = hitAm++;
+				while (j > 0 && childDist[order[j - 1]] < childDist[i]) {
+					order[j] = order[j - 1];
+					--j;
+				}
+				order[j] = i;
+			}
+			for (int k = 0; k < hitAm; ++k) {
+				stack[stackSize].child = node->child[order[k]];
+				stack[stackSize].rayMask = childRays[order[k]];
+				stack[stackSize].dist = childDist[order[k]];
+				++stackSize;
+			}
+		}
+	}
+}
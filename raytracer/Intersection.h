@@ -0,0 +1,26 @@
+#pragma once
+#include <glm/glm.hpp>
+
+namespace AGR {
+	struct Material;
+	class Primitive;
+
+	struct Ray
+	{
+		glm::vec3 origin;
+		glm::vec3 direction;
+		glm::vec3 *pixel;
+		glm::vec3 energy;
+		//material of the object the ray travels through, null outside of objects
+		const Material *surroundMaterial;
+	};
+
+	struct Intersection
+	{
+		float ray_length;
+		Primitive *p_object;
+		//position of the hit among the leaf primitives of the bvh that found it,
+		//for hits through a mesh instance that of the triangle in the mesh bvh
+		int primitive_index;
+	};
+}
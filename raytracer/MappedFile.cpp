@@ -0,0 +1,70 @@
+#include "MappedFile.h"
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace AGR
+{
+#ifdef _WIN32
+	bool MappedFile::open(const std::string& path)
+	{
+		close();
+		HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) return false;
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+			CloseHandle(file);
+			return false;
+		}
+		HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+		CloseHandle(file);
+		if (!mapping) return false;
+		//the view keeps the mapping alive on its own
+		m_data = static_cast<char *>(MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0));
+		CloseHandle(mapping);
+		if (!m_data) return false;
+		m_size = static_cast<size_t>(size.QuadPart);
+		return true;
+	}
+
+	void MappedFile::close()
+	{
+		if (m_data) UnmapViewOfFile(m_data);
+		m_data = nullptr;
+		m_size = 0;
+	}
+#else
+	bool MappedFile::open(const std::string& path)
+	{
+		close();
+		int file = ::open(path.c_str(), O_RDONLY);
+		if (file < 0) return false;
+		struct stat info;
+		if (fstat(file, &info) != 0 || info.st_size == 0) {
+			::close(file);
+			return false;
+		}
+		void *data = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+		::close(file);
+		if (data == MAP_FAILED) return false;
+		m_data = static_cast<char *>(data);
+		m_size = static_cast<size_t>(info.st_size);
+		return true;
+	}
+
+	void MappedFile::close()
+	{
+		if (m_data) munmap(m_data, m_size);
+		m_data = nullptr;
+		m_size = 0;
+	}
+#endif
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <string>
+
+namespace AGR
+{
+	//whole file mapped into memory, writes go to private copies of the pages
+	//and never reach the file
+	class MappedFile
+	{
+	public:
+		MappedFile() {}
+		~MappedFile() { close(); }
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+		bool open(const std::string& path);
+		void close();
+		bool isOpen() const { return m_data != nullptr; }
+		char *getData() const { return m_data; }
+		size_t getSize() const { return m_size; }
+	private:
+		char *m_data = nullptr;
+		size_t m_size = 0;
+	};
+}
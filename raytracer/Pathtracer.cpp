@@ -8,15 +8,16 @@ namespace AGR
 	Pathtracer::Pathtracer(const Camera& c, Sampler *skydomeTex,
 		const glm::vec2& resolution) :
 		Renderer(c, skydomeTex, resolution, true),
-		m_isSceneUpdated(true)
+		m_isSceneUpdated(true),
+		m_isSceneTransformed(false)
 	{}
 
-	void Pathtracer::Sample(Ray& r, int d)
+	bool Pathtracer::continuePath(Ray& r, int d)
 	{
 		static std::random_device rd;
 		static std::mt19937 gen(rd());
 		if (d > MIN_PATH_LEN) {
-			if (d > MAX_PATH_LEN) return;
+			if (d > MAX_PATH_LEN) return false;
 			std::uniform_real_distribution<> dis0to1(0.0f, 1.0f);
 			float probability = r.energy.x;
 			probability = r.energy.y > probability ? r.energy.y : probability;
@@ -24,13 +25,19 @@ namespace AGR
 			probability *= (1.0f - float(d));
 			float randNum = dis0to1(gen);
 			if (randNum > probability)
-				return;
+				return false;
 			r.energy /= probability;
 		}
-		Intersection hit;
+		return true;
+	}
+
+	bool Pathtracer::Sample(Ray& r, const Intersection& hit, Ray *outNext)
+	{
+		static std::random_device rd;
+		static std::mt19937 gen(rd());
 		glm::vec2 texCoord;
 		glm::vec3 normal;
-		if (!m_bvh.Traverse(r, hit, -1.0f)) {
+		if (hit.ray_length < 0) {
 			r.origin = glm::vec3();
 			float dist = m_skydome->intersect(r);
 			glm::vec2 texcoord;
@@ -50,11 +57,11 @@ namespace AGR
 			if (maxComp > maxEdge) color = color / maxComp * maxEdge;
 			if (r.surroundMaterial) {
 				*r.pixel += r.energy * r.surroundMaterial->innerColor * color;
-				return;
+				return false;
 			}
 			
 			*r.pixel += color * r.energy;
-			return;
+			return false;
 		}
 		if (r.surroundMaterial) {
 			const Material *m = r.surroundMaterial;
@@ -62,7 +69,7 @@ namespace AGR
 			r.energy -= r.energy * (1.0f - remainedIntensity) * (1.0f - m->innerColor);
 		}
 		const Material *m = hit.p_object->getMaterial();
-		hit.p_object->getTexCoordAndNormal(r, hit.ray_length, texCoord, normal);
+		hit.p_object->getHitTexCoordAndNormal(r, hit, texCoord, normal);
 		std::uniform_real_distribution<> dis(0.0f, 
 			m->diffuseIntensity + m->reflectionIntensity + m->refractionIntensity);
 		float materialType = dis(gen);
@@ -84,8 +91,8 @@ namespace AGR
 				float brdfPdf = glm::dot(next.direction, normal) / M_PI;
 				*r.pixel += directColor * r.energy * (lPdf / (lPdf + brdfPdf));
 				*r.pixel += color * m->glowIntensity * r.energy * (brdfPdf / (lPdf + brdfPdf));
-				Sample(next, d + 1);
-				return;
+				*outNext = next;
+				return true;
 			}
 			materialType -= m->diffuseIntensity;
 			float trueReflection = m->reflectionIntensity;
@@ -111,8 +118,8 @@ namespace AGR
 					if (materialType < trueRefraction) {
 						next.energy = r.energy;
 						next.pixel = r.pixel;
-						Sample(next, d + 1);
-						return;
+						*outNext = next;
+						return true;
 					}
 				}
 				else {
@@ -127,8 +134,8 @@ namespace AGR
 				next.energy = r.energy * color;
 				next.pixel = r.pixel;
 				next.surroundMaterial = r.surroundMaterial;
-				Sample(next, d + 1);
-				return;
+				*outNext = next;
+				return true;
 			}
 			*r.pixel += color * m->glowIntensity * r.energy;
 		} else {
@@ -136,10 +143,10 @@ namespace AGR
 			next.origin = hit.ray_length * r.direction + r.origin + normal * shiftValue;
 			float brdfPdf = 0.0f;
 			next.direction = microfacetReflection(normal, r.direction, m->microfacetAlpha, &brdfPdf);
-			if (glm::dot(next.direction, normal) < 0) return;
+			if (glm::dot(next.direction, normal) < 0) return false;
 			next.pixel = r.pixel;
 			glm::vec3 brdf = calcMicrofacetBrdf(m, r.direction, next.direction, normal, color);
-			if (brdf.x < FLT_EPSILON && brdf.y < FLT_EPSILON && brdf.z < FLT_EPSILON) return;
+			if (brdf.x < FLT_EPSILON && brdf.y < FLT_EPSILON && brdf.z < FLT_EPSILON) return false;
 			next.energy = r.energy * brdf * glm::dot(normal, next.direction) / brdfPdf;
 			next.surroundMaterial = r.surroundMaterial;
 			float lPdf;
@@ -148,8 +155,10 @@ namespace AGR
 			*r.pixel += color * m->glowIntensity * r.energy * (brdfPdf / (lPdf + brdfPdf));
 			if (isnan(r.pixel->x))
 				r.pixel->x = 1;
-			Sample(next, d + 1);
+			*outNext = next;
+			return true;
 		}
+		return false;
 	}
 
 	glm::vec3 Pathtracer::SampleDirect(glm::vec3& pt, glm::vec3& incoming,
@@ -163,19 +172,19 @@ namespace AGR
 		std::uniform_int_distribution<> dist(0, m_lightsForSampling.size() - 1);
 		int lightIdx = dist(gen);
 		Primitive *light = m_lightsForSampling[lightIdx];
-		glm::vec3 ptOnLight = light->getRandomPoint();
+		glm::vec2 texCoord;
+		glm::vec3 lightNormal;
+		glm::vec3 ptOnLight = light->sampleSurface(pt, texCoord, lightNormal);
 		Ray r;
 		float distToLight = glm::distance(ptOnLight, pt);
 
 
 		r.origin = pt;
 		r.direction = (ptOnLight - pt) / distToLight;
-		Intersection hit;
-		glm::vec2 texCoord;
-		glm::vec3 lightNormal;
-		light->getTexCoordAndNormal(r, distToLight, texCoord, lightNormal);
 		if (glm::dot(normal, r.direction) > 0 && glm::dot(lightNormal, -r.direction) > 0) {
-			if (!m_bvh.Traverse(r, hit, distToLight - 1.0) || hit.p_object == light) {
+			//stops a fraction of the distance short, so only the sampled point of
+			//the light is left out, whatever the scale of the scene
+			if (!m_bvh.CheckOcclusion(r, distToLight * (1.0f - SHADOW_RAY_SHORTENING))) {
 				glm::vec3 brdf;
 				if (m->isMicrofacet) {
 					brdf = calcMicrofacetBrdf(m, incoming, r.direction, normal, color);
@@ -199,14 +208,46 @@ namespace AGR
 	void Pathtracer::traceRays(std::vector<Ray>& rays)
 	{
 		if (m_isSceneUpdated) {
-			m_bvh.construct(m_primitives);
+			if (m_bvhCachePath.empty()) {
+				m_bvh.construct(m_primitives);
+			} else {
+				m_bvh.construct(m_primitives, m_bvhCachePath);
+			}
 			updateLightsProbs();
 			m_isSceneUpdated = false;
+			m_isSceneTransformed = false;
+		} else if (m_isSceneTransformed) {
+			m_bvh.refit();
+			updateLightsProbs();
+			m_isSceneTransformed = false;
+		} else if (m_bvh.commitUpdates()) {
+			updateLightsProbs();
+		}
+		//the paths advance a bounce at a time, so all the rays of a bounce are
+		//traced together, the ones still going on make up the next bounce
+		std::vector<Ray> *bounce = &rays;
+		for (int d = 0; !bounce->empty(); ++d) {
+			if (d < SORTED_RAYS_DEPTH) {
+				m_bvh.PacketTraverse(*bounce, m_pathHits);
+			} else if (m_interleavedTraversal) {
+				m_bvh.InterleavedTraverse(*bounce, m_pathHits);
+			} else {
+				m_bvh.SortedPacketTraverse(*bounce, m_pathHits);
+			}
+			m_nextRays.resize(bounce->size());
+			m_isPathAlive.resize(bounce->size());
+			concurrency::parallel_for(0, (int)bounce->size(), 1, [this, bounce, d](int i) {
+				m_isPathAlive[i] = Sample((*bounce)[i], m_pathHits[i], &m_nextRays[i]) &&
+					continuePath(m_nextRays[i], d + 1);
+			});
+			int aliveAm = 0;
+			for (int i = 0; i < m_nextRays.size(); ++i) {
+				if (m_isPathAlive[i]) m_nextRays[aliveAm++] = m_nextRays[i];
+			}
+			m_nextRays.resize(aliveAm);
+			m_pathRays.swap(m_nextRays);
+			bounce = &m_pathRays;
 		}
-		concurrency::parallel_for(0, (int)rays.size(), 1, [this, &rays](int i) {
-		//for (int i = 0; i < rays.size(); ++i) {
-			Sample(rays[i], 0);
-		});
 	}
 
 	void Pathtracer::combineImg(std::vector<glm::vec3>& buf)
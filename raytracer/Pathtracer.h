@@ -7,8 +7,14 @@ namespace AGR {
 	public:
 		Pathtracer(const Camera &c, Sampler *skydomeTex, const glm::vec2& resolution);
 		void SceneUpdated() { m_isSceneUpdated = true; }
+		//primitives were only moved, the acceleration structure gets refitted
+		void SceneTransformed() { m_isSceneTransformed = true; }
 	private:
-		void Sample(Ray &r, int d);
+		//russian roulette for the ray of depth d, false when the path ends
+		bool continuePath(Ray &r, int d);
+		//shades the closest hit of r, false when the path ends there,
+		//otherwise outNext is the ray of the next bounce
+		bool Sample(Ray &r, const Intersection &hit, Ray *outNext);
 		glm::vec3 SampleDirect(glm::vec3& pt, glm::vec3& incoming, 
 			glm::vec3& normal, glm::vec3& color, 
 			float *outPdf, const Material *m);
@@ -26,8 +32,18 @@ namespace AGR {
 		int m_amountOfIterations = 0;
 		const int MIN_PATH_LEN = 5;
 		const int MAX_PATH_LEN = 128;
+		//camera rays and their first bounces are still coherent in pixel order,
+		//the later bounces are sorted before being traced
+		const int SORTED_RAYS_DEPTH = 2;
+		//fraction of the distance to the light the shadow rays stop short of it
+		const float SHADOW_RAY_SHORTENING = 1e-4f;
 		std::vector<Primitive *> m_lightsForSampling;
 		std::vector<float> m_lightProbs;
+		std::vector<Ray> m_pathRays;
+		std::vector<Ray> m_nextRays;
+		std::vector<Intersection> m_pathHits;
+		std::vector<char> m_isPathAlive;
 		bool m_isSceneUpdated;
+		bool m_isSceneTransformed;
 	};
 }
\ No newline at end of file
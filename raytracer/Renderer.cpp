@@ -23,6 +23,7 @@ namespace AGR {
 	{
 		if (m_primitivesIndices.try_emplace(&r, m_primitives.size()).second) {
 			m_primitives.push_back(&r);
+			if (m_bvh.isBuilt()) m_bvh.insert(&r);
 		}
 	}
 
@@ -34,6 +35,7 @@ namespace AGR {
 			m_primitives[it->second] = *m_primitives.rbegin();
 			m_primitives.pop_back();
 			m_primitivesIndices.erase(it);
+			if (m_bvh.isBuilt()) m_bvh.remove(&r);
 		}
 	}
 
@@ -128,6 +130,46 @@ namespace AGR {
 		m_vignettingAlpha = alpha;
 	}
 
+	void Renderer::setBVHBuildMethod(BVH::BuildMethod method)
+	{
+		m_bvh.setBuildMethod(method);
+	}
+
+	void Renderer::setBVHTreeletPasses(int passes)
+	{
+		m_bvh.setTreeletPasses(passes);
+	}
+
+	void Renderer::setBVHSpatialSplitBudget(float budget)
+	{
+		m_bvh.setSpatialSplitBudget(budget);
+	}
+
+	void Renderer::setBVHNodeWidth(int width)
+	{
+		m_bvh.setNodeWidth(width);
+	}
+
+	void Renderer::setBVHCompressedNodes(bool compressed)
+	{
+		m_bvh.setCompressedNodes(compressed);
+	}
+
+	void Renderer::setBVHMaxLeafSize(int size)
+	{
+		m_bvh.setMaxLeafSize(size);
+	}
+
+	void Renderer::setBVHCachePath(const std::string& path)
+	{
+		m_bvhCachePath = path;
+	}
+
+	void Renderer::setBVHInterleavedTraversal(bool interleaved)
+	{
+		m_interleavedTraversal = interleaved;
+	}
+
 	const glm::uvec2 & Renderer::getResolution() const
 	{
 		return m_resolution;
@@ -25,6 +25,19 @@ namespace AGR {
 		void setGammaCorrection(bool correct, float gamma = 2.2f, float exposure = 1.0f);
 		void setSepia(bool enabled);
 		void setVignetting(bool enabled, float alpha = 1.0f);
+		//takes effect on the next acceleration structure rebuild
+		void setBVHBuildMethod(BVH::BuildMethod method);
+		void setBVHTreeletPasses(int passes);
+		void setBVHSpatialSplitBudget(float budget);
+		//4 or 8 children per traversal node, 8 wide nodes need avx2
+		void setBVHNodeWidth(int width);
+		void setBVHCompressedNodes(bool compressed);
+		void setBVHMaxLeafSize(int size);
+		//full rebuilds reuse the tree stored there while the geometry is unchanged
+		void setBVHCachePath(const std::string& path);
+		//incoherent bounces are traced with several rays in flight per thread
+		//instead of as sorted packets, faster once the scene outgrows the caches
+		void setBVHInterleavedTraversal(bool interleaved);
 		const glm::uvec2 & getResolution() const;
 		const unsigned long *getImage();
 	protected:
@@ -44,6 +57,8 @@ namespace AGR {
 		glm::uvec2 m_resolution;
 		const Camera *m_camera;
 		BVH m_bvh;
+		std::string m_bvhCachePath;
+		bool m_interleavedTraversal = false;
 		bool m_useAntialiasing;
 		const float shiftValue = FLT_EPSILON * 500;
 
@@ -1,7 +1,10 @@
 #include "Mesh.h"
 #include <tiny_obj_loader.h>    
+#include "MeshInstance.h"
 #include "../util.h"
 #include <vector>
+#include <random>
+#include <algorithm>
 
 namespace AGR
 {
@@ -108,6 +111,40 @@ namespace AGR
 		for (int i = 0; i < m_triangles.size(); ++i)
 			delete m_triangles[i];
 		m_triangles.clear();
+		m_areaPrefixSums.clear();
+		m_isBVHBuilt = false;
+	}
+
+	void Mesh::buildBVH()
+	{
+		if (m_isBVHBuilt || m_triangles.empty()) return;
+		std::vector<Primitive *> triangles(m_triangles.begin(), m_triangles.end());
+		m_bvh.construct(triangles);
+		calcAreaPrefixSums();
+		m_isBVHBuilt = true;
+	}
+
+	void Mesh::calcAreaPrefixSums()
+	{
+		m_areaPrefixSums.resize(m_triangles.size());
+		float area = 0.0f;
+		for (int i = 0; i < m_triangles.size(); ++i) {
+			const glm::vec3& v0 = m_triangles[i]->getVertex(0).position;
+			area += glm::length(glm::cross(m_triangles[i]->getVertex(1).position - v0,
+				m_triangles[i]->getVertex(2).position - v0)) * 0.5f;
+			m_areaPrefixSums[i] = area;
+		}
+	}
+
+	Triangle *Mesh::getRandomTriangle() const
+	{
+		//area weighted, so points are uniform over the surface
+		static std::random_device rd;
+		static std::mt19937 gen(rd());
+		std::uniform_real_distribution<> distr(0.0f, m_areaPrefixSums.back());
+		size_t idx = std::upper_bound(m_areaPrefixSums.begin(), m_areaPrefixSums.end(),
+			static_cast<float>(distr(gen))) - m_areaPrefixSums.begin();
+		return m_triangles[std::min(idx, m_triangles.size() - 1)];
 	}
 
 	void Mesh::commitTransformations()
@@ -135,5 +172,11 @@ namespace AGR
 			}
 			t->commitTransformations();
 		}
+		if (m_isBVHBuilt) {
+			m_bvh.refit();
+			calcAreaPrefixSums();
+			for (MeshInstance *instance : m_instances)
+				instance->commitTransformations();
+		}
 	}
 }
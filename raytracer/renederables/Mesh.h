@@ -1,9 +1,12 @@
 #pragma once
 #include "Primitive.h" 
 #include "Triangle.h"
+#include "../BVH.h"
 #include <vector>
 
 namespace AGR {
+	class MeshInstance;
+
 	enum NormalType
 	{
 		FLAT, SMOOTH, CONSISTENT
@@ -12,6 +15,7 @@ namespace AGR {
 	class Mesh
 	{
 		friend class Renderer;
+		friend class MeshInstance;
 	public:
 		Mesh(Material& m) 
 			: m_material(&m),
@@ -20,15 +24,30 @@ namespace AGR {
 			m_scale(1){}
 		~Mesh() { release(); }
 		bool load(const std::string& path, NormalType nt = CONSISTENT);
+		//for meshes not loaded from a file, the mesh takes the triangle over,
+		//all of them have to be added before the first instance
+		void addTriangle(Triangle *triangle) { m_triangles.push_back(triangle); }
+		const std::vector<Triangle *>& getTriangles() const { return m_triangles; }
 		void setPosition(const glm::vec3& p);
 		void setRotation(const glm::vec3& r);
 		void setScale(const glm::vec3& s);
 		AABB getAABB();
 		void commitTransformations();
 		void release();
+		//bottom level structure shared by all instances of the mesh,
+		//built in mesh space on the first request
+		void buildBVH();
 	private:
+		void calcAreaPrefixSums();
+		Triangle *getRandomTriangle() const;
+
 		std::vector<Triangle *> m_triangles;
 		Material *m_material;
+		BVH m_bvh;
+		bool m_isBVHBuilt = false;
+		std::vector<float> m_areaPrefixSums;
+		//they follow the transformations of the mesh
+		std::vector<MeshInstance *> m_instances;
 
 		glm::mat4x4 m_modMatrix;
 		glm::mat4x4 m_normModMatrix;
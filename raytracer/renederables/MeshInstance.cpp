@@ -0,0 +1,173 @@
+#include "MeshInstance.h"
+#include "../util.h"
+#include <algorithm>
+
+namespace AGR
+{
+	MeshInstance::MeshInstance(Mesh& mesh, Material* m)
+		: Primitive(m ? *m : *mesh.m_material),
+		m_mesh(&mesh),
+		m_translation(0),
+		m_rotation(0),
+		m_scale(1)
+	{
+		m_mesh->buildBVH();
+		m_mesh->m_instances.push_back(this);
+		commitTransformations();
+	}
+
+	MeshInstance::~MeshInstance()
+	{
+		std::vector<MeshInstance *>& instances = m_mesh->m_instances;
+		instances.erase(std::remove(instances.begin(), instances.end(), this), instances.end());
+	}
+
+	void MeshInstance::toMeshSpace(const Ray& r, Ray& out) const
+	{
+		out = r;
+		out.origin = glm::vec3(m_invModMatrix * glm::vec4(r.origin, 1));
+		//not normalized, so distances along the ray stay the same in both spaces
+		out.direction = glm::vec3(m_invModMatrix * glm::vec4(r.direction, 0));
+	}
+
+	float MeshInstance::intersect(const Ray &r) const
+	{
+		Intersection hit;
+		if (!traverseMesh<BVH::ClosestHit, BVH::AllFaces>(r, FLT_MAX, hit)) return -1.0f;
+		return hit.ray_length;
+	}
+
+	template<class Query, class Faces>
+	bool MeshInstance::traverseMesh(const Ray& r, float tmax, Intersection& hit) const
+	{
+		//dot products of face normals and directions keep their signs in mesh
+		//space, as setScale does not let the transformation mirror, so the same
+		//faces are culled
+		Ray localRay;
+		toMeshSpace(r, localRay);
+		Intersection localHit;
+		if (!m_mesh->m_bvh.Traverse<Query, Faces>(localRay, localHit, tmax)) return false;
+		hit.ray_length = localHit.ray_length;
+		hit.p_object = const_cast<MeshInstance *>(this);
+		hit.primitive_index = localHit.primitive_index;
+		return true;
+	}
+
+	void MeshInstance::getTexCoordAndNormal(const Ray& r, float dist,
+		glm::vec2& texCoord, glm::vec3& normal) const
+	{
+		Intersection hit;
+		if (!traverseMesh<BVH::ClosestHit, BVH::AllFaces>(r, FLT_MAX, hit)) {
+			texCoord = glm::vec2();
+			normal = -r.direction;
+			return;
+		}
+		getHitTexCoordAndNormal(r, hit, texCoord, normal);
+	}
+
+	void MeshInstance::getHitTexCoordAndNormal(const Ray& r, const Intersection& hit,
+		glm::vec2& texCoord, glm::vec3& normal) const
+	{
+		const Triangle *t = m_mesh->m_bvh.getLeafPrimitive(hit.primitive_index)->asTriangle();
+		shadeTriangle(*t, r, hit.ray_length, texCoord, normal);
+	}
+
+	void MeshInstance::shadeTriangle(const Triangle& t, const Ray& r, float dist,
+		glm::vec2& texCoord, glm::vec3& normal) const
+	{
+		Ray localRay;
+		toMeshSpace(r, localRay);
+		float scale = glm::length(localRay.direction);
+		localRay.direction /= scale;
+		t.getTexCoordAndNormal(localRay, dist * scale, texCoord, normal,
+			m_material->isTexCoordRequired());
+		normal = glm::normalize(glm::vec3(m_normModMatrix * glm::vec4(normal, 0)));
+	}
+
+	void MeshInstance::setPosition(const glm::vec3& p)
+	{
+		m_translation = p;
+	}
+
+	void MeshInstance::setRotation(const glm::vec3& r)
+	{
+		m_rotation = r;
+	}
+
+	void MeshInstance::setScale(const glm::vec3& s)
+	{
+		m_scale = glm::abs(s);
+	}
+
+	void MeshInstance::commitTransformations()
+	{
+		m_modMatrix = glm::mat4x4();
+		transformMat(m_translation, m_rotation, m_scale, m_modMatrix);
+		m_invModMatrix = glm::inverse(m_modMatrix);
+		m_normModMatrix = glm::transpose(m_invModMatrix);
+		const AABB& bounds = m_mesh->m_bvh.getBounds();
+		m_aabb = AABB::empty();
+		for (int i = 0; i < 8; ++i) {
+			glm::vec3 corner(i & 1 ? bounds.getMaxPt().x : bounds.getMinPt().x,
+				i & 2 ? bounds.getMaxPt().y : bounds.getMinPt().y,
+				i & 4 ? bounds.getMaxPt().z : bounds.getMinPt().z);
+			corner = glm::vec3(m_modMatrix * glm::vec4(corner, 1));
+			m_aabb.extend(AABB(corner, corner));
+		}
+		m_area = 0.0f;
+		m_projectedAreas = glm::vec3(0.0f);
+		for (const Triangle *t : m_mesh->m_triangles) {
+			glm::vec3 v0 = glm::vec3(m_modMatrix * glm::vec4(t->getVertex(0).position, 1));
+			glm::vec3 v1 = glm::vec3(m_modMatrix * glm::vec4(t->getVertex(1).position, 1));
+			glm::vec3 v2 = glm::vec3(m_modMatrix * glm::vec4(t->getVertex(2).position, 1));
+			glm::vec3 areaVector = glm::cross(v1 - v0, v2 - v0) * 0.5f;
+			m_area += glm::length(areaVector);
+			//a closed surface shows half of its area along any axis
+			m_projectedAreas += glm::abs(areaVector) * 0.5f;
+		}
+	}
+
+	glm::vec3 MeshInstance::getRandomPoint()
+	{
+		//uniform over the mesh space surface, exact for uniform scales
+		glm::vec3 pt = m_mesh->getRandomTriangle()->getRandomPoint();
+		return glm::vec3(m_modMatrix * glm::vec4(pt, 1));
+	}
+
+	glm::vec3 MeshInstance::sampleSurface(const glm::vec3& from, glm::vec2& texCoord, glm::vec3& normal)
+	{
+		//the sampled triangle is shaded directly instead of being searched for
+		Triangle *t = m_mesh->getRandomTriangle();
+		glm::vec3 pt = glm::vec3(m_modMatrix * glm::vec4(t->getRandomPoint(), 1));
+		Ray r;
+		float dist = glm::distance(pt, from);
+		r.origin = from;
+		r.direction = (pt - from) / dist;
+		shadeTriangle(*t, r, dist, texCoord, normal);
+		return pt;
+	}
+
+	float MeshInstance::getArea()
+	{
+		return m_area;
+	}
+
+	float MeshInstance::calcSolidAngle(glm::vec3& pt)
+	{
+		glm::vec3 toCenter = m_aabb.getCenter() - pt;
+		float sqrDist = glm::dot(toCenter, toCenter);
+		if (sqrDist == 0.0f) return 2 * M_PI;
+		glm::vec3 dir = toCenter / glm::sqrt(sqrDist);
+		float projectedArea = glm::dot(glm::abs(dir), m_projectedAreas);
+		return glm::min(projectedArea / sqrDist, static_cast<float>(2 * M_PI));
+	}
+
+	template bool MeshInstance::traverseMesh<BVH::ClosestHit, BVH::AllFaces>(const Ray&, float,
+		Intersection&) const;
+	template bool MeshInstance::traverseMesh<BVH::ClosestHit, BVH::NoBackfaces>(const Ray&, float,
+		Intersection&) const;
+	template bool MeshInstance::traverseMesh<BVH::AnyHit, BVH::AllFaces>(const Ray&, float,
+		Intersection&) const;
+	template bool MeshInstance::traverseMesh<BVH::AnyHit, BVH::NoBackfaces>(const Ray&, float,
+		Intersection&) const;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include "Primitive.h"
+#include "Mesh.h"
+
+namespace AGR {
+
+	//top level primitive referencing a mesh with its own transformation,
+	//rays are moved to the mesh space and traverse the mesh bvh
+	class MeshInstance : public Primitive {
+	public:
+		//uses the mesh material when m is null
+		MeshInstance(Mesh& mesh, Material* m = nullptr);
+		~MeshInstance();
+
+		float intersect(const Ray &r) const override;
+		//searches the mesh again, the hits of traverseMesh already name their triangle
+		void getTexCoordAndNormal(const Ray& r, float dist,
+			glm::vec2& texCoord, glm::vec3& normal) const override;
+		void getHitTexCoordAndNormal(const Ray& r, const Intersection& hit,
+			glm::vec2& texCoord, glm::vec3& normal) const override;
+		const MeshInstance *asMeshInstance() const override { return this; }
+		//the mesh bvh traversed with the query and faces policy of BVH::Traverse,
+		//hits closer than tmax only, the distance is along r, the hit object is
+		//the instance and primitive_index names the triangle in the mesh bvh
+		template<class Query, class Faces>
+		bool traverseMesh(const Ray& r, float tmax, Intersection& hit) const;
+
+		void setPosition(const glm::vec3& p);
+		void setRotation(const glm::vec3& r);
+		//mirroring scales are taken by their absolute values, culling in mesh
+		//space would otherwise drop the front faces of the instance
+		void setScale(const glm::vec3& s);
+
+		//the mesh calls it again for its instances when it is transformed
+		void commitTransformations();
+		glm::vec3 getRandomPoint() override;
+		glm::vec3 sampleSurface(const glm::vec3& from, glm::vec2& texCoord, glm::vec3& normal) override;
+		float getArea() override;
+		//from the areas the instance projects along the axes, exact for boxes
+		//seen from afar, at most a hemisphere
+		float calcSolidAngle(glm::vec3& pt) override;
+	private:
+		void toMeshSpace(const Ray& r, Ray& out) const;
+		void shadeTriangle(const Triangle& t, const Ray& r, float dist,
+			glm::vec2& texCoord, glm::vec3& normal) const;
+
+		Mesh *m_mesh;
+		glm::mat4x4 m_modMatrix;
+		glm::mat4x4 m_invModMatrix;
+		glm::mat4x4 m_normModMatrix;
+		glm::vec3 m_translation;
+		glm::vec3 m_rotation;
+		glm::vec3 m_scale;
+		//of the transformed surface, updated by commitTransformations
+		float m_area;
+		glm::vec3 m_projectedAreas;
+	};
+
+}
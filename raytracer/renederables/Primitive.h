@@ -4,6 +4,10 @@
 #include "../AABB.h"
 
 namespace AGR {
+	class Triangle;
+	class Sphere;
+	class MeshInstance;
+
 	class Primitive {
 	friend class Raytracer;
 	friend class BVH;
@@ -14,17 +18,51 @@ namespace AGR {
 		virtual float intersect(const Ray &r) const = 0;
 		virtual void getTexCoordAndNormal(const Ray& r, float dist, 
 			glm::vec2& texCoord, glm::vec3& normal) const = 0;
+		//shading of a hit found by the bvh, primitives made of several triangles
+		//read which one was hit from the intersection
+		virtual void getHitTexCoordAndNormal(const Ray& r, const Intersection& hit,
+			glm::vec2& texCoord, glm::vec3& normal) const
+		{
+			getTexCoordAndNormal(r, hit.ray_length, texCoord, normal);
+		}
 		const AABB& getBoundingBox() const { return m_aabb; }
 		const Material* getMaterial() const { return m_material; }
 		virtual glm::vec3 getRandomPoint() = 0;
 		virtual float calcSolidAngle(glm::vec3& pt) = 0;
 		virtual float getArea() = 0;
+		//random point of the surface with its shading as seen from a point
+		virtual glm::vec3 sampleSurface(const glm::vec3& from, glm::vec2& texCoord, glm::vec3& normal)
+		{
+			glm::vec3 pt = getRandomPoint();
+			Ray r;
+			float dist = glm::distance(pt, from);
+			r.origin = from;
+			r.direction = (pt - from) / dist;
+			getTexCoordAndNormal(r, dist, texCoord, normal);
+			return pt;
+		}
+		//the BVH copies the intersection data of triangles and spheres into its
+		//leaves, other primitives are intersected through their own intersect
+		virtual const Triangle *asTriangle() const { return nullptr; }
+		virtual const Sphere *asSphere() const { return nullptr; }
+		//instances are traversed by the BVH with the query of the traversal
+		//that reached them instead of through intersect
+		virtual const MeshInstance *asMeshInstance() const { return nullptr; }
+		//bounds of the parts of the primitive inside bounds on both sides
+		//of the axis aligned plane, used by spatial splits
+		virtual void splitBounds(int axis, float position, const AABB& bounds,
+			AABB& left, AABB& right) const
+		{
+			glm::vec3 leftMax = bounds.getMaxPt();
+			glm::vec3 rightMin = bounds.getMinPt();
+			leftMax[axis] = position;
+			rightMin[axis] = position;
+			left = AABB(bounds.getMinPt(), leftMax);
+			right = AABB(rightMin, bounds.getMaxPt());
+		}
 	protected:
 		Material *m_material;
 		AABB m_aabb;
-	private:
-		//used for BVH constructions
-		::uint64_t m_mortonCode;
 	};
 
 }
\ No newline at end of file
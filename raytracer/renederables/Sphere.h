@@ -11,6 +11,7 @@ namespace AGR {
 		float intersect(const Ray &r) const override;
 		void getTexCoordAndNormal(const Ray& r, float dist,
 			glm::vec2& texCoord, glm::vec3& normal) const override;
+		const Sphere *asSphere() const override { return this; }
 
 		const glm::vec3& getPosition() const;
 		void setPosition(const glm::vec3& position);
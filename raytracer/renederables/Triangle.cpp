@@ -32,12 +32,18 @@ namespace AGR
 
 	void Triangle::getTexCoordAndNormal(const Ray& r, float dist,
 		glm::vec2& texCoord, glm::vec3& normal) const
+	{
+		getTexCoordAndNormal(r, dist, texCoord, normal, m_material->isTexCoordRequired());
+	}
+
+	void Triangle::getTexCoordAndNormal(const Ray& r, float dist, glm::vec2& texCoord,
+		glm::vec3& normal, bool texCoordRequired) const
 	{
 		glm::vec3 pt = r.direction * dist + r.origin;
 		glm::vec3 baryc;
 		calcBarycentricCoord(pt, baryc, false);
 		
-		if (m_material->isTexCoordRequired()) {
+		if (texCoordRequired) {
 			texCoord = m_vert[0].texCoord * baryc.x +
 				m_vert[1].texCoord * baryc.y +
 				m_vert[2].texCoord * baryc.z;
@@ -173,4 +179,33 @@ namespace AGR
 			glm::dot(v0, v2) * d1 +
 			glm::dot(v1, v2) * d0));
 	}
+
+	void Triangle::splitBounds(int axis, float position, const AABB& bounds,
+		AABB& left, AABB& right) const
+	{
+		left = AABB::empty();
+		right = AABB::empty();
+		for (int i = 0; i < 3; ++i) {
+			const glm::vec3& v0 = m_vert[i].position;
+			const glm::vec3& v1 = m_vert[(i + 1) % 3].position;
+			if (v0[axis] <= position) left.extend(AABB(v0, v0));
+			if (v0[axis] >= position) right.extend(AABB(v0, v0));
+			if ((v0[axis] < position && v1[axis] > position) ||
+				(v0[axis] > position && v1[axis] < position)) {
+				glm::vec3 pt = v0 + (v1 - v0) * ((position - v0[axis]) / (v1[axis] - v0[axis]));
+				pt[axis] = position;
+				left.extend(AABB(pt, pt));
+				right.extend(AABB(pt, pt));
+			}
+		}
+		//same padding as the full bounding box, clipped to the input bounds
+		glm::vec3 leftMax = bounds.getMaxPt();
+		glm::vec3 rightMin = bounds.getMinPt();
+		leftMax[axis] = position;
+		rightMin[axis] = position;
+		left = AABB(glm::max(left.getMinPt() - glm::vec3(0.01f), bounds.getMinPt()),
+			glm::min(left.getMaxPt() + glm::vec3(0.01f), leftMax));
+		right = AABB(glm::max(right.getMinPt() - glm::vec3(0.01f), rightMin),
+			glm::min(right.getMaxPt() + glm::vec3(0.01f), bounds.getMaxPt()));
+	}
 }
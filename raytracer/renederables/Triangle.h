@@ -20,6 +20,7 @@ namespace AGR {
 
 
 	class Triangle : public Primitive {
+	friend class BVH;
 	public:
 		//when limit is false triangle becomes a plane
 		Triangle(const Vertex& v1, const Vertex& v2, const Vertex& v3,
@@ -30,6 +31,9 @@ namespace AGR {
 		float intersect(const Ray &r) const override;
 		void getTexCoordAndNormal(const Ray& r, float dist,
 			glm::vec2& texCoord, glm::vec3& normal) const override;
+		//for callers shading the triangle with another material, e.g. mesh instances
+		void getTexCoordAndNormal(const Ray& r, float dist, glm::vec2& texCoord,
+			glm::vec3& normal, bool texCoordRequired) const;
 
 		void setVertex(int num, const Vertex& val);
 
@@ -50,6 +54,10 @@ namespace AGR {
 		void commitTransformations();
 		float getArea() override;
 		float calcSolidAngle(glm::vec3& pt) override;
+		void splitBounds(int axis, float position, const AABB& bounds,
+			AABB& left, AABB& right) const override;
+		//planes keep their own intersect
+		const Triangle *asTriangle() const override { return m_limit ? this : nullptr; }
 	private:
 		bool calcBarycentricCoord(const glm::vec3& pt, glm::vec3& out, bool limit) const;
 		Vertex m_vert[3];
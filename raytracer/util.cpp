@@ -1,7 +1,47 @@
-
 #include "util.h"
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
 
 namespace AGR {
 
-	
+	void cpuid(int info[4], int leaf)
+	{
+#ifdef _MSC_VER
+		__cpuidex(info, leaf, 0);
+#else
+		__cpuid_count(leaf, 0, info[0], info[1], info[2], info[3]);
+#endif
+	}
+
+	//register state the os saves on context switches
+	static ::uint64_t readXcr0()
+	{
+#ifdef _MSC_VER
+		return _xgetbv(0);
+#else
+		::uint32_t lo, hi;
+		__asm__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+		return (static_cast<::uint64_t>(hi) << 32) | lo;
+#endif
+	}
+
+	bool isAvx2Supported()
+	{
+		static const bool isSupported = [] {
+			int info[4];
+			cpuid(info, 0);
+			if (info[0] < 7) return false;
+			cpuid(info, 1);
+			const int fmaOsxsaveAvx = (1 << 12) | (1 << 27) | (1 << 28);
+			if ((info[2] & fmaOsxsaveAvx) != fmaOsxsaveAvx) return false;
+			//xmm and ymm registers
+			if ((readXcr0() & 6) != 6) return false;
+			cpuid(info, 7);
+			return (info[1] & (1 << 5)) != 0;
+		}();
+		return isSupported;
+	}
 }
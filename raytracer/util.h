@@ -72,6 +72,11 @@ namespace AGR {
 		}
 	}
 
+	//eax, ebx, ecx and edx of the cpuid leaf, sub leaf 0
+	void cpuid(int info[4], int leaf);
+	//whether the cpu and the os support AVX2 and FMA, the cpu is only asked once
+	bool isAvx2Supported();
+
 	constexpr int constpow(const int base, const int pow) {
 		return pow == 1 ? base : (base * constpow(base, pow - 1));
 	}